@@ -1,56 +1,127 @@
 #include "BootSector.h"
 #include "utils/stream-utils.h"
 
-BootSector::BootSector(int diskSize) : mDiskSize(diskSize * FORMAT_UNIT) {
+#include <algorithm>
+#include <ostream>
+#include <stdexcept>
+
+BootSector::BootSector(int diskSize, int clusterSize) : mDiskSize(static_cast<int64_t>(diskSize) * FORMAT_UNIT) {
     mSignature = SIGNATURE;
-    mClusterSize = CLUSTER_SIZE;
+    mClusterSize = clusterSize;
     mFatCount = FAT_COUNT;
+    mVersion = FS_VERSION;
 
-    size_t freeSpaceInBytes = mDiskSize - BootSector::SIZE;
-    mClusterCount = static_cast<int>(freeSpaceInBytes / (sizeof(int32_t) + mClusterSize));
-    mFatSize = static_cast<int>(mClusterCount * sizeof(int32_t));
+    auto journalReserveSize = getJournalReserveSize(mClusterSize);
+    int64_t freeSpaceInBytes = mDiskSize - BootSector::SIZE - journalReserveSize;
+    mClusterCount = static_cast<int>(getClusterCount(diskSize, mClusterSize));
+    mFatSize = mClusterCount * static_cast<int64_t>(sizeof(int32_t));
     mFat1StartAddress = BootSector::SIZE;
+    mJournalSize = mFatSize + journalReserveSize;
 
-    size_t dataSize = mClusterCount * mClusterSize;
-    size_t fatTablesSize = mFatSize * mFatCount;
-    mPaddingSize = static_cast<int>(freeSpaceInBytes - (dataSize + fatTablesSize));
+    int64_t dataSize = static_cast<int64_t>(mClusterCount) * mClusterSize;
+    int64_t fatTablesSize = mFatSize * mFatCount;
+    mPaddingSize = freeSpaceInBytes + journalReserveSize - (dataSize + fatTablesSize + mJournalSize);
 
     auto fatEndAddress = mFat1StartAddress + mFatSize;
-    mDataStartAddress = static_cast<int>(mPaddingSize + fatEndAddress);
+    mJournalStartAddress = fatEndAddress;
+    mDataStartAddress = mPaddingSize + mJournalStartAddress + mJournalSize;
+}
+
+int64_t BootSector::getClusterCount(int diskSize, int clusterSize) {
+    // journal has to fit rewrite of the whole FAT, i.e. sizeof(int32_t) per cluster
+    int64_t freeSpaceInBytes = static_cast<int64_t>(diskSize) * FORMAT_UNIT - BootSector::SIZE
+                               - getJournalReserveSize(clusterSize);
+    if (freeSpaceInBytes <= 0) return 0;
+    return freeSpaceInBytes / static_cast<int64_t>(2 * sizeof(int32_t) + clusterSize);
+}
+
+/**
+ * Journal space on top of the FAT size, fits several whole directory clusters.
+ */
+int BootSector::getJournalReserveSize(int clusterSize) {
+    return std::max(JOURNAL_RESERVE_SIZE, JOURNAL_RESERVE_CLUSTERS * clusterSize);
 }
 
-void BootSector::write(std::fstream &f) {
+/**
+ * Always writes the current version.
+ */
+void BootSector::write(IStorage &f) {
+    int32_t legacyField = 0; // 32-bit fields superseded by the 64-bit ones
     writeToStream(f, mSignature, SIGNATURE_LENGTH);
     writeToStream(f, mClusterSize);
     writeToStream(f, mClusterCount);
-    writeToStream(f, mDiskSize);
+    writeToStream(f, legacyField); // disk size, zero marks version 3+
     writeToStream(f, mFatCount);
+    writeToStream(f, legacyField); // FAT1 start address
+    writeToStream(f, legacyField); // data start address
+    writeToStream(f, legacyField); // padding size
+    writeToStream(f, mVersion);
+    writeToStream(f, legacyField); // journal start address
+    writeToStream(f, legacyField); // journal size
+    writeToStream(f, mDiskSize);
     writeToStream(f, mFat1StartAddress);
     writeToStream(f, mDataStartAddress);
     writeToStream(f, mPaddingSize);
+    writeToStream(f, mJournalStartAddress);
+    writeToStream(f, mJournalSize);
 }
 
-void BootSector::read(std::fstream &f) {
+void BootSector::read(IStorage &f) {
+    int32_t diskSize, fat1StartAddress, dataStartAddress, paddingSize;
     readFromStream(f, mSignature, SIGNATURE_LENGTH);
     readFromStream(f, mClusterSize);
     readFromStream(f, mClusterCount);
-    readFromStream(f, mDiskSize);
+    readFromStream(f, diskSize);
     readFromStream(f, mFatCount);
-    readFromStream(f, mFat1StartAddress);
-    readFromStream(f, mDataStartAddress);
-    readFromStream(f, mPaddingSize);
+    readFromStream(f, fat1StartAddress);
+    readFromStream(f, dataStartAddress);
+    readFromStream(f, paddingSize);
+
+    if (diskSize == 0) {
+        // version 3+, 64-bit sizes and addresses
+        int32_t legacyField;
+        readFromStream(f, mVersion);
+        readFromStream(f, legacyField);
+        readFromStream(f, legacyField);
+        readFromStream(f, mDiskSize);
+        readFromStream(f, mFat1StartAddress);
+        readFromStream(f, mDataStartAddress);
+        readFromStream(f, mPaddingSize);
+        readFromStream(f, mJournalStartAddress);
+        readFromStream(f, mJournalSize);
+    } else {
+        mDiskSize = diskSize;
+        mFat1StartAddress = fat1StartAddress;
+        mDataStartAddress = dataStartAddress;
+        mPaddingSize = paddingSize;
+
+        // version 1 boot sector is followed directly by the FAT
+        int32_t journalStartAddress = 0, journalSize = 0;
+        mVersion = 1;
+        if (mFat1StartAddress >= V2_SIZE) {
+            readFromStream(f, mVersion);
+            readFromStream(f, journalStartAddress);
+            readFromStream(f, journalSize);
+        }
+        mJournalStartAddress = journalStartAddress;
+        mJournalSize = journalSize;
+    }
 
-    mFatSize = static_cast<int>(mClusterCount * sizeof(int32_t));
+    mFatSize = mClusterCount * static_cast<int64_t>(sizeof(int32_t));
 }
 
 std::ostream &operator<<(std::ostream &os, BootSector const &bs) {
     return os << "  Signature: " << bs.mSignature.c_str() << "\n"
+              << "  Version: " << bs.mVersion << "\n"
               << "  ClusterSize: " << bs.mClusterSize << "B\n"
               << "  ClusterCount: " << bs.mClusterCount << "\n"
               << "  DiskSize: " << bs.mDiskSize / FORMAT_UNIT << "MB\n"
               << "  FatCount: " << bs.mFatCount << "\n"
               << "  Fat1StartAddress: " << bs.mFat1StartAddress << "-" << bs.mFat1StartAddress + bs.mFatSize << "\n"
               << "  Padding size: " << bs.mPaddingSize << "B\n"
-              << "  PaddingAddress: " << bs.mFat1StartAddress + bs.mFatSize << "-" << bs.mDataStartAddress << "\n"
+              << "  JournalAddress: " << bs.mJournalStartAddress << "-"
+              << bs.mJournalStartAddress + bs.mJournalSize << "\n"
+              << "  PaddingAddress: " << bs.mFat1StartAddress + bs.mFatSize + bs.mJournalSize << "-"
+              << bs.mDataStartAddress << "\n"
               << "  DataStartAddress: " << bs.mDataStartAddress << "\n";
 }
\ No newline at end of file
@@ -2,36 +2,54 @@
 #define ZOS_SP_BOOTSECTOR_H
 
 #include "definitions.h"
+#include "IStorage.h"
 
 class BootSector {
 private:
-    int mFatSize;
+    int64_t mFatSize;
 public:
     // actual memory structure
     std::string mSignature;
     int mClusterSize;
     int mClusterCount;
-    int mDiskSize;
+    int64_t mDiskSize;
     int mFatCount;
-    int mFat1StartAddress;
-    int mDataStartAddress;     //adresa pocatku datovych bloku (hl. adresar)
-    int mPaddingSize;
+    int64_t mFat1StartAddress;
+    int64_t mDataStartAddress;     //adresa pocatku datovych bloku (hl. adresar)
+    int64_t mPaddingSize;
+    // version 2+
+    int mVersion;
+    int64_t mJournalStartAddress;
+    int64_t mJournalSize;
 
-    static const int SIZE = SIGNATURE_LENGTH + sizeof(mClusterSize) + sizeof(mClusterCount) +
-                            sizeof(mDiskSize) + sizeof(mFatCount) + sizeof(mFat1StartAddress) +
-                            sizeof(mDataStartAddress) + sizeof(mPaddingSize);
+    // size of version 1 boot sector, i.e. signature and 7 32-bit fields
+    static const int BASE_SIZE = SIGNATURE_LENGTH + 7 * sizeof(int32_t);
+
+    // version 2 adds 32-bit version and journal address and size
+    static const int V2_SIZE = BASE_SIZE + 3 * sizeof(int32_t);
+
+    // version 3 zeroes 32-bit disk size and addresses, 64-bit ones follow
+    static const int SIZE = V2_SIZE + 6 * sizeof(int64_t);
 
     BootSector(){}
 
-    explicit BootSector(int diskSize);
+    explicit BootSector(int diskSize, int clusterSize = DEFAULT_CLUSTER_SIZE);
+
+    /**
+     * @param diskSize In FORMAT_UNIT.
+     * @return Number of data clusters of the disk, 0 if it's too small.
+     */
+    static int64_t getClusterCount(int diskSize, int clusterSize);
+
+    static int getJournalReserveSize(int clusterSize);
 
-    void write(std::fstream &f);
+    void write(IStorage &f);
 
-    void read(std::fstream &f);
+    void read(IStorage &f);
 
     friend std::ostream &operator<<(std::ostream &os, BootSector const &fs);
 
-    int getFatSize() const { return this->mFatSize; };
+    int64_t getFatSize() const { return this->mFatSize; };
 };
 
 
@@ -1,10 +1,17 @@
 #include "Commands.h"
+#include "utils/parallel.h"
 #include "utils/string-utils.h"
 #include "utils/validators.h"
 
 #include <algorithm>
+#include <cerrno>
 #include <fstream>
 #include <cmath>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 
 enum class ECommands {
@@ -23,12 +30,13 @@ enum class ECommands {
     eLoadCommand,
     eFormatCommand,
     eDefragCommand,
+    eDedupCommand,
     // Classless commands
     eExitCommand,
     eUnknownCommand,
 };
 
-constexpr ECommands getCommandCode(std::string const &string) {
+ECommands getCommandCode(std::string const &string) {
     if (string == "cp") return ECommands::eCpCommand;
     if (string == "mv") return ECommands::eMvCommand;
     if (string == "rm") return ECommands::eRmCommand;
@@ -44,6 +52,7 @@ constexpr ECommands getCommandCode(std::string const &string) {
     if (string == "load") return ECommands::eLoadCommand;
     if (string == "format") return ECommands::eFormatCommand;
     if (string == "defrag") return ECommands::eDefragCommand;
+    if (string == "dedup") return ECommands::eDedupCommand;
     if (string == "exit") return ECommands::eExitCommand;
     return ECommands::eUnknownCommand;
 }
@@ -78,7 +87,6 @@ bool handleUserInput(std::vector<std::string> arguments, const std::shared_ptr<F
             break;
         case ECommands::eCdCommand:
             CdCommand(options).registerFS(pFS).process();
-            pFS->updateWorkingDirectoryPath();
             break;
         case ECommands::ePwdCommand:
             PwdCommand(options).registerFS(pFS).process();
@@ -101,10 +109,13 @@ bool handleUserInput(std::vector<std::string> arguments, const std::shared_ptr<F
         case ECommands::eDefragCommand:
             DefragCommand(options).registerFS(pFS).process();
             break;
+        case ECommands::eDedupCommand:
+            DedupCommand(options).registerFS(pFS).process();
+            break;
         case ECommands::eExitCommand:
             return false;
         case ECommands::eUnknownCommand:
-            std::cout << "fs: Unknown command: " << command << std::endl;
+            pFS->getSession().out() << "fs: " << UNKNOWN_COMMAND_ERROR << ": " << command << std::endl;
             break;
     }
     return true;
@@ -120,8 +131,12 @@ void pathCheck(const std::string &path) {
 //===============================================================================
 
 bool CpCommand::run() {
+    if (hasSwitch("-r")) return runRecursive();
+
     // File to copy
     DirectoryEntry fromDE = mFS->getLastRelativeDirectoryEntry(mAccumulator1, EFileOption::FILE);
+    mAccumulator1.pop_back();
+    auto fromParentDE = mFS->getLastRelativeDirectoryEntry(mAccumulator1, EFileOption::DIRECTORY);
 
     // New file name
     auto newFileName = mAccumulator2.back();
@@ -133,6 +148,14 @@ bool CpCommand::run() {
     if (mFS->directoryEntryExists(parentDE.mStartCluster, newFileName, true))
         throw InvalidOptionException(EXIST_ERROR);
 
+    if (hasSwitch("--reflink") || mFS->isDeduplicating()) {
+        // Share source clusters, data are copied only when either file changes
+        DirectoryEntry newFileDE{newFileName, true, 0, 0};
+        mFS->shareFileChain(fromParentDE.mStartCluster, fromDE, newFileDE);
+        mFS->writeNewDirectoryEntry(parentDE.mStartCluster, newFileDE);
+        return true;
+    }
+
     // From clusters
     auto fromClusters = mFS->getFatClusterChain(fromDE.mStartCluster, fromDE.mSize);
 
@@ -142,16 +165,112 @@ bool CpCommand::run() {
     // Chain clusters in FAT tables
     mFS->makeFatChain(freeClusters);
 
-    // Move data
+    // Move data, compressed files are copied as they are stored
     auto fileData = mFS->readFile(fromClusters, fromDE.mSize);
     mFS->writeFile(freeClusters, fileData);
 
     // Write new directory entry
     DirectoryEntry newFileDE{newFileName, true, fromDE.mSize, freeClusters.at(0)};
+    newFileDE.mIsCompressed = fromDE.mIsCompressed;
     mFS->writeNewDirectoryEntry(parentDE.mStartCluster, newFileDE);
     return true;
 }
 
+/**
+ * Copies the subtree, which is collected first so a copy placed inside its
+ * source ends. Clusters of all files are allocated at once and chained in
+ * one batch of FAT changes, data are then copied by a pool of threads inside
+ * the image and the file entries written once all data are in place.
+ */
+bool CpCommand::runRecursive() {
+    auto fromDE = mFS->getLastRelativeDirectoryEntry(mAccumulator1, EFileOption::DIRECTORY);
+
+    auto newDirectoryName = mAccumulator2.back();
+    mAccumulator2.pop_back();
+    auto parentDE = mFS->getLastRelativeDirectoryEntry(mAccumulator2, EFileOption::DIRECTORY);
+
+    if (mFS->directoryEntryExists(parentDE.mStartCluster, newDirectoryName, false))
+        throw InvalidOptionException(EXIST_ERROR);
+
+    // parents precede their children
+    std::vector<TreeItem> fromDirectories{{fromDE, -1}};
+    std::vector<TreeItem> fromFiles{};
+    for (size_t i = 0; i < fromDirectories.size(); i++) {
+        auto directory = mFS->getIndexedDirectory(fromDirectories[i].mEntry.mStartCluster);
+        for (int slot = DEFAULT_DIR_SIZE; slot < directory->size(); slot++) {
+            DirectoryEntry de{directory->at(slot)};
+            de.mItemName = std::string{de.mItemName.c_str()}; // record names are padded
+            (de.mIsFile ? fromFiles : fromDirectories).push_back({de, static_cast<int>(i)});
+        }
+    }
+
+    bool share = hasSwitch("--reflink") || mFS->isDeduplicating();
+    int neededClusters = 0;
+    std::vector<int> fileClusters(fromFiles.size());
+    for (size_t i = 0; i < fromFiles.size() && !share; i++) {
+        fileClusters[i] = std::max(1, mFS->getNeededClustersCount(fromFiles[i].mEntry.mSize));
+        neededClusters += fileClusters[i];
+    }
+    // Fail before anything is created (growth of the new directories aside)
+    if (neededClusters + static_cast<int64_t>(fromDirectories.size()) > mFS->getFreeClusterCount())
+        throw InvalidOptionException(NOT_ENOUGH_SPACE_ERROR);
+
+    std::vector<DirectoryEntry> directories{};
+    for (auto &it: fromDirectories) {
+        DirectoryEntry parent = it.mParent < 0 ? parentDE : directories[it.mParent];
+        directories.push_back(mFS->makeDirectory(parent, it.mParent < 0 ? newDirectoryName : it.mEntry.mItemName));
+    }
+
+    if (share) {
+        for (auto &it: fromFiles) {
+            DirectoryEntry newFileDE{it.mEntry.mItemName, true, 0, 0};
+            mFS->shareFileChain(fromDirectories[it.mParent].mEntry.mStartCluster, it.mEntry, newFileDE);
+            mFS->writeNewDirectoryEntry(directories[it.mParent].mStartCluster, newFileDE);
+        }
+        return true;
+    }
+
+    // Files are laid out one after another in clusters allocated at once
+    std::vector<std::vector<int>> clusters(fromFiles.size());
+    std::vector<FatLabel> labels{};
+    if (neededClusters > 0) {
+        auto freeClusters = mFS->getFreeClusters(neededClusters);
+        labels.reserve(freeClusters.size());
+        auto next = freeClusters.begin();
+        for (size_t i = 0; i < fromFiles.size(); i++) {
+            clusters[i].assign(next, next + fileClusters[i]);
+            next += fileClusters[i];
+            for (size_t j = 0; j + 1 < clusters[i].size(); j++) {
+                labels.push_back({clusters[i][j], clusters[i][j + 1]});
+            }
+            labels.push_back({clusters[i].back(), FAT_FILE_END});
+        }
+    }
+    mFS->writeFatLabels(labels);
+
+    mFS->flush();
+    try {
+        parallelFor(fromFiles.size(), getWorkerCount(fromFiles.size()), [this, &fromFiles, &clusters](size_t i) {
+            auto &de = fromFiles[i].mEntry;
+            mFS->copyFile(mFS->getFatClusterChain(de.mStartCluster, de.mSize), clusters[i], de.mSize);
+        });
+    } catch (...) {
+        for (auto &it: labels) {
+            it.mLabel = FAT_UNUSED;
+        }
+        mFS->writeFatLabels(labels);
+        throw;
+    }
+
+    for (size_t i = 0; i < fromFiles.size(); i++) {
+        auto &de = fromFiles[i].mEntry;
+        DirectoryEntry newFileDE{de.mItemName, true, de.mSize, clusters[i].at(0)};
+        newFileDE.mIsCompressed = de.mIsCompressed;
+        mFS->writeNewDirectoryEntry(directories[fromFiles[i].mParent].mStartCluster, newFileDE);
+    }
+    return true;
+}
+
 bool CpCommand::validateArguments() {
     if (mOptCount != 2) return false;
     pathCheck(mOpt1);
@@ -194,15 +313,40 @@ bool MvCommand::validateArguments() {
 }
 
 bool RmCommand::run() {
+    if (hasSwitch("-r")) return runRecursive();
+
     auto fileDE = mFS->getLastRelativeDirectoryEntry(mAccumulator, EFileOption::FILE);
     mAccumulator.pop_back();
     auto directoryDE = mFS->getLastRelativeDirectoryEntry(mAccumulator, EFileOption::DIRECTORY);
 
-    auto clusters = mFS->getFatClusterChain(fileDE.mStartCluster, fileDE.mSize);
-    mFS->labelFatClusterChain(clusters, FAT_UNUSED);
+    mFS->releaseFileChain(fileDE);
     return mFS->removeDirectoryEntry(directoryDE.mStartCluster, fileDE.mItemName, true);
 }
 
+/**
+ * Unlinks the directory first, then frees the whole subtree in one batch of
+ * FAT changes.
+ */
+bool RmCommand::runRecursive() {
+    auto toRemoveDE = mFS->getLastRelativeDirectoryEntry(mAccumulator, EFileOption::DIRECTORY);
+    mAccumulator.pop_back();
+    auto parentDE = mFS->getLastRelativeDirectoryEntry(mAccumulator, EFileOption::DIRECTORY);
+
+    auto directories = mFS->getDirectoryTree(toRemoveDE.mStartCluster);
+    for (auto &it: directories) {
+        if (it == mFS->getWorkingDirectory().mStartCluster)
+            throw InvalidOptionException(CONTAINS_WORKING_DIRECTORY_ERROR);
+        if (mFS->isWorkingDirectoryOfOtherSession(it))
+            throw InvalidOptionException(DIRECTORY_IN_USE_ERROR);
+    }
+
+    if (!mFS->removeDirectoryEntry(parentDE.mStartCluster, toRemoveDE.mItemName, false))
+        throw InvalidOptionException(DELETE_DIR_REFERENCE_ERROR);
+
+    mFS->releaseDirectoryTree(directories);
+    return true;
+}
+
 bool RmCommand::validateArguments() {
     if (mOptCount != 1) return false;
     pathCheck(mOpt1);
@@ -220,17 +364,7 @@ bool MkdirCommand::run() {
     if (mFS->directoryEntryExists(parentDE.mStartCluster, newDirectoryName, false))
         throw InvalidOptionException(EXIST_ERROR);
 
-    int32_t newFreeCluster = mFS->getFreeClusters().back();
-
-    // Update parent directory with the new directory entry
-    DirectoryEntry newDE{newDirectoryName, false, 0, newFreeCluster};
-    mFS->writeNewDirectoryEntry(parentDE.mStartCluster, newDE);
-
-    // Write references ".' and ".."
-    mFS->writeDirectoryEntryReferences(parentDE, newDE, newFreeCluster);
-
-    // All went ok, label new cluster as allocated
-    mFS->writeToFatByCluster(newFreeCluster, FAT_FILE_END);
+    mFS->makeDirectory(parentDE, newDirectoryName);
     return true;
 }
 
@@ -252,11 +386,15 @@ bool RmdirCommand::run() {
     if (mFS->getDirectoryEntryCount(toRemoveDE.mStartCluster) > DEFAULT_DIR_SIZE)
         throw InvalidOptionException(NOT_EMPTY_ERROR);
 
+    if (mFS->isWorkingDirectoryOfOtherSession(toRemoveDE.mStartCluster))
+        throw InvalidOptionException(DIRECTORY_IN_USE_ERROR);
+
     bool removed = mFS->removeDirectoryEntry(parentDE.mStartCluster, toRemoveDE.mItemName, false);
 
     if (!removed) throw InvalidOptionException(DELETE_DIR_REFERENCE_ERROR);
 
-    mFS->writeToFatByCluster(toRemoveDE.mStartCluster, FAT_UNUSED);
+    auto clusters = mFS->getFatClusterChain(toRemoveDE.mStartCluster);
+    mFS->labelFatClusterChain(clusters, FAT_UNUSED);
 
     return true;
 }
@@ -276,9 +414,9 @@ bool LsCommand::run() {
     auto fileNames = mFS->getDirectoryContents(de.mStartCluster);
 
     for (auto &fn: fileNames) {
-        std::cout << fn.c_str() << " ";
+        out() << fn.c_str() << " ";
     }
-    std::cout << std::endl;
+    out() << std::endl;
     return true;
 }
 
@@ -293,11 +431,12 @@ bool LsCommand::validateArguments() {
 bool CatCommand::run() {
     DirectoryEntry de = mFS->getLastRelativeDirectoryEntry(mAccumulator, EFileOption::FILE);
     auto clusters = mFS->getFatClusterChain(de.mStartCluster, de.mSize);
-    auto fileData = mFS->readFile(clusters, de.mSize);
-    for (auto &it: fileData) {
-        std::cout << it;
+    if (de.mIsCompressed) {
+        mFS->readCompressedFile(clusters, de.mSize, out());
+    } else {
+        mFS->readFile(clusters, de.mSize, out());
     }
-    std::cout << std::endl;
+    out() << std::endl;
     return true;
 }
 
@@ -320,7 +459,7 @@ bool CdCommand::run() {
             throw std::runtime_error(CORRUPTED_FS_ERROR);
     }
 
-    mFS->mWorkingDirectory = de;
+    mFS->setWorkingDirectory(de);
     return true;
 }
 
@@ -332,7 +471,7 @@ bool CdCommand::validateArguments() {
 }
 
 bool PwdCommand::run() {
-    std::cout << mFS->getWorkingDirectoryPath() << std::endl;
+    out() << mFS->getWorkingDirectoryPath() << std::endl;
     return true;
 }
 
@@ -344,16 +483,16 @@ bool InfoCommand::run() {
     DirectoryEntry de = mFS->getLastRelativeDirectoryEntry(mAccumulator);
 
     if (!de.mIsFile) {
-        std::cout << de << std::endl;
+        out() << de << std::endl;
         return true;
     }
 
     auto clusters = mFS->getFatClusterChain(de.mStartCluster, de.mSize);
 
     for (auto &it: clusters) {
-        std::cout << it << " ";
+        out() << it << " ";
     }
-    std::cout << std::endl;
+    out() << std::endl;
 
     return true;
 }
@@ -366,48 +505,219 @@ bool InfoCommand::validateArguments() {
 }
 
 bool IncpCommand::run() {
-    int fileSize = static_cast<int>(mBuffer.size());
+    if (hasSwitch("-r")) return runRecursive();
+
+    auto newFileName = mAccumulator.back();
+    mAccumulator.pop_back();
+
+    auto parentDE = mFS->getLastRelativeDirectoryEntry(mAccumulator, EFileOption::DIRECTORY);
+
+    if (mFS->directoryEntryExists(parentDE.mStartCluster, newFileName, true))
+        throw InvalidOptionException(EXIST_ERROR);
+
+    storeFile(parentDE.mStartCluster, newFileName, mHostFile, mFileSize);
+    return true;
+}
+
+/**
+ * Stores host stream as a new file of the directory, compressed or shared
+ * with an identical file if asked to.
+ */
+void IncpCommand::storeFile(int parentCluster, const std::string &fileName, std::ifstream &stream, int64_t fileSize) {
+    if (hasSwitch("--compress")) {
+        // Worst case is every chunk stored raw, unused clusters are dropped afterwards
+        CompressedFile layout{static_cast<uint64_t>(fileSize)};
+        auto clusters = mFS->getFreeClusters(mFS->getNeededClustersCount(layout.tableSize() + fileSize));
+        int64_t storedSize = mFS->writeCompressedFile(clusters, stream, fileSize);
+        clusters.resize(mFS->getNeededClustersCount(storedSize));
+        mFS->makeFatChain(clusters);
+
+        DirectoryEntry newFileDE{fileName, true, storedSize, clusters.at(0)};
+        newFileDE.mIsCompressed = true;
+        mFS->writeNewDirectoryEntry(parentCluster, newFileDE);
+        return;
+    }
+
+    uint64_t contentHash = 0;
+    if (mFS->isDeduplicating() && fileSize > 0) {
+        contentHash = mFS->hashStream(stream, fileSize);
+
+        // Same contents are already stored, share their clusters
+        int sourceParentCluster;
+        DirectoryEntry sourceDE;
+        if (mFS->findDuplicate(contentHash, fileSize, stream, sourceParentCluster, sourceDE)) {
+            DirectoryEntry newFileDE{fileName, true, 0, 0};
+            mFS->shareFileChain(sourceParentCluster, sourceDE, newFileDE);
+            mFS->writeNewDirectoryEntry(parentCluster, newFileDE);
+            mFS->indexFile(contentHash, parentCluster, newFileDE);
+            return;
+        }
+    }
+
     int neededClusters = (fileSize) ? mFS->getNeededClustersCount(fileSize) : 1;
 
-    // Get free clusters
+    // Get free clusters, whole file is placed at once so it can stay contiguous
     auto clusters = mFS->getFreeClusters(neededClusters);
 
+    // Stream data
+    mFS->writeFile(clusters, stream, fileSize);
+
     // Mark clusters in FAT tables
     mFS->makeFatChain(clusters);
 
-    // Move data
-    mFS->writeFile(clusters, mBuffer);
+    DirectoryEntry newFileDE{fileName, true, fileSize, clusters.at(0)};
+    mFS->writeNewDirectoryEntry(parentCluster, newFileDE);
+    if (mFS->isDeduplicating() && fileSize > 0)
+        mFS->indexFile(contentHash, parentCluster, newFileDE);
+}
 
-    auto newFileName = mAccumulator.back();
+/**
+ * Imports the host tree collected by validateArguments. Directories and
+ * cluster allocation are done in order on this thread, file data are then
+ * copied by a pool of threads straight into the allocated clusters and the
+ * file entries written once all data are in place.
+ */
+bool IncpCommand::runRecursive() {
+    auto newDirectoryName = mAccumulator.back();
     mAccumulator.pop_back();
 
     auto parentDE = mFS->getLastRelativeDirectoryEntry(mAccumulator, EFileOption::DIRECTORY);
 
-    if (mFS->directoryEntryExists(parentDE.mStartCluster, newFileName, true))
+    if (mFS->directoryEntryExists(parentDE.mStartCluster, newDirectoryName, false))
         throw InvalidOptionException(EXIST_ERROR);
 
-    DirectoryEntry newFileDE{newFileName, true, fileSize, clusters.at(0)};
-    mFS->writeNewDirectoryEntry(parentDE.mStartCluster, newFileDE);
+    // Fail before anything is created (growth of the new directories aside)
+    int64_t neededClusters = static_cast<int64_t>(mHostDirectories.size());
+    for (auto &it: mHostFiles) {
+        neededClusters += std::max(1, mFS->getNeededClustersCount(getMaxStoredSize(it.mSize)));
+    }
+    if (neededClusters > mFS->getFreeClusterCount())
+        throw InvalidOptionException(NOT_ENOUGH_SPACE_ERROR);
+
+    std::vector<DirectoryEntry> directories{};
+    for (auto &it: mHostDirectories) {
+        DirectoryEntry parent = it.mParent < 0 ? parentDE : directories[it.mParent];
+        directories.push_back(mFS->makeDirectory(parent, it.mName));
+    }
+
+    if (hasSwitch("--compress") || mFS->isDeduplicating()) {
+        // both go through fs code reading the host stream, files are stored one by one
+        for (auto &it: mHostFiles) {
+            std::ifstream stream(it.mHostPath, std::ios::binary);
+            if (!stream.good())
+                throw InvalidOptionException(FILE_NOT_FOUND_ERROR);
+            storeFile(directories[it.mParent].mStartCluster, it.mName, stream, it.mSize);
+        }
+        return true;
+    }
+
+    // Whole file is allocated at once so it can stay contiguous
+    std::vector<std::vector<int>> clusters(mHostFiles.size());
+    for (size_t i = 0; i < mHostFiles.size(); i++) {
+        clusters[i] = mFS->getFreeClusters(std::max(1, mFS->getNeededClustersCount(mHostFiles[i].mSize)));
+        mFS->makeFatChain(clusters[i]);
+    }
+
+    mFS->flush();
+    try {
+        parallelFor(mHostFiles.size(), getWorkerCount(mHostFiles.size()), [this, &clusters](size_t i) {
+            int fd = open(mHostFiles[i].mHostPath.c_str(), O_RDONLY);
+            if (fd < 0)
+                throw InvalidOptionException(FILE_NOT_FOUND_ERROR);
+            try {
+                mFS->importFile(clusters[i], mHostFiles[i].mSize, fd);
+            } catch (...) {
+                close(fd);
+                throw;
+            }
+            close(fd);
+        });
+    } catch (...) {
+        for (auto &it: clusters) {
+            mFS->labelFatClusterChain(it, FAT_UNUSED);
+        }
+        throw;
+    }
+
+    for (size_t i = 0; i < mHostFiles.size(); i++) {
+        DirectoryEntry newFileDE{mHostFiles[i].mName, true, mHostFiles[i].mSize, clusters[i].at(0)};
+        mFS->writeNewDirectoryEntry(directories[mHostFiles[i].mParent].mStartCluster, newFileDE);
+    }
     return true;
 }
 
+/**
+ * Stored size of compressed file may exceed the original by its chunk table.
+ */
+int64_t IncpCommand::getMaxStoredSize(int64_t fileSize) const {
+    if (!hasSwitch("--compress")) return fileSize;
+    return fileSize + static_cast<int64_t>(CompressedFile{static_cast<uint64_t>(fileSize)}.tableSize());
+}
+
+/**
+ * Collects directories and regular files of the host tree, other kinds of
+ * entries (links, devices, ...) are skipped. Entries are sorted by name so
+ * the import is deterministic.
+ */
+void IncpCommand::collectHostTree(const std::string &hostPath, const std::string &name, int parent) {
+    int index = static_cast<int>(mHostDirectories.size());
+    mHostDirectories.push_back({hostPath, name, parent, 0});
+
+    DIR *directory = opendir(hostPath.c_str());
+    if (!directory)
+        throw InvalidOptionException(FILE_NOT_FOUND_ERROR);
+    std::vector<std::string> names{};
+    while (auto entry = readdir(directory)) {
+        std::string entryName{entry->d_name};
+        if (entryName != "." && entryName != "..") names.push_back(entryName);
+    }
+    closedir(directory);
+    std::sort(names.begin(), names.end());
+
+    for (auto &it: names) {
+        auto path = hostPath + "/" + it;
+        struct stat st{};
+        if (lstat(path.c_str(), &st) != 0 || !(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))) continue;
+
+        if (it.length() >= ITEM_NAME_LENGTH)
+            throw InvalidOptionException(FILE_NAME_TOO_LONG_ERROR);
+
+        if (S_ISDIR(st.st_mode)) {
+            collectHostTree(path, it, index);
+            continue;
+        }
+        if (getMaxStoredSize(st.st_size) > mFS->getMaxFileSize())
+            throw InvalidOptionException(FILE_TOO_LARGE_ERROR);
+        mHostFiles.push_back({path, it, index, static_cast<int64_t>(st.st_size)});
+    }
+}
+
 bool IncpCommand::validateArguments() {
     if (mOptCount != 2) return false;
 
-    std::ifstream stream(mOpt1, std::ios::binary | std::ios::ate);
+    if (hasSwitch("-r")) {
+        pathCheck(mOpt2);
+        mAccumulator = split(mOpt2, "/");
+        if (mAccumulator.back().length() >= ITEM_NAME_LENGTH)
+            throw InvalidOptionException(FILE_NAME_TOO_LONG_ERROR);
 
-    if (!stream.good())
-        throw InvalidOptionException(FILE_NOT_FOUND_ERROR);
+        struct stat st{};
+        if (stat(mOpt1.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+            throw InvalidOptionException(FILE_NOT_FOUND_ERROR);
+        collectHostTree(mOpt1, mAccumulator.back(), -1);
+        return true;
+    }
 
-    std::streamsize size = stream.tellg();
-    stream.seekg(0, std::ios::beg);
+    mHostFile.open(mOpt1, std::ios::binary | std::ios::ate);
 
-    mBuffer = std::vector<char>(size);
+    if (!mHostFile.good())
+        throw InvalidOptionException(FILE_NOT_FOUND_ERROR);
 
-    if (!stream.read(mBuffer.data(), size))
-        throw std::runtime_error(FILE_READ_ERROR);
+    mFileSize = static_cast<int64_t>(mHostFile.tellg());
+    mHostFile.seekg(0, std::ios::beg);
 
-    stream.close();
+    if (getMaxStoredSize(mFileSize) > mFS->getMaxFileSize())
+        throw InvalidOptionException(FILE_TOO_LARGE_ERROR);
 
     pathCheck(mOpt2);
     mAccumulator = split(mOpt2, "/");
@@ -419,20 +729,77 @@ bool IncpCommand::validateArguments() {
 }
 
 bool OutcpCommand::run() {
+    if (hasSwitch("-r")) return runRecursive();
+
     DirectoryEntry de = mFS->getLastRelativeDirectoryEntry(mAccumulator, EFileOption::FILE);
+    exportFile(de, mOpt2);
+    return true;
+}
+
+void OutcpCommand::exportFile(const DirectoryEntry &de, const std::string &hostPath) {
     auto clusters = mFS->getFatClusterChain(de.mStartCluster, de.mSize);
-    auto fileData = mFS->readFile(clusters, de.mSize);
 
-    std::ofstream stream(mOpt2, std::ios::binary);
+    if (de.mIsCompressed) {
+        std::ofstream stream(hostPath, std::ios::binary);
 
-    if (!stream.good())
+        if (!stream.good())
+            throw InvalidOptionException(FILE_NOT_FOUND_ERROR);
+
+        mFS->readCompressedFile(clusters, de.mSize, stream);
+        return;
+    }
+
+    int fd = open(hostPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0)
         throw InvalidOptionException(FILE_NOT_FOUND_ERROR);
 
-    stream.write((char *) &fileData[0], static_cast<int>(fileData.size()));
+    try {
+        mFS->exportFile(clusters, de.mSize, fd);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+}
+
+/**
+ * Exports the subtree on a work-stealing pool, every directory is a task
+ * creating its host directory and spawning tasks for its items, so walking
+ * the tree, reading FAT chains and copying file data all run in parallel.
+ */
+bool OutcpCommand::runRecursive() {
+    DirectoryEntry de = mFS->getLastRelativeDirectoryEntry(mAccumulator, EFileOption::DIRECTORY);
+
+    if (mkdir(mOpt2.c_str(), 0755) != 0)
+        throw InvalidOptionException(errno == EEXIST ? EXIST_ERROR : PATH_NOT_FOUND_ERROR);
 
+    TaskPool pool{mFS->supportsConcurrentReads() ? getWorkerCount() : 1};
+    auto hostPath = mOpt2;
+    pool.spawn([this, &pool, de, hostPath] { exportDirectory(pool, de.mStartCluster, hostPath); });
+    pool.run();
     return true;
 }
 
+void OutcpCommand::exportDirectory(TaskPool &pool, int cluster, const std::string &hostPath) {
+    auto directory = mFS->getIndexedDirectory(cluster);
+    for (int i = 0; i < directory->size(); i++) {
+        DirectoryEntry de{directory->at(i)};
+        std::string name{de.mItemName.c_str()};
+        auto path = hostPath + "/" + name;
+
+        if (de.mIsFile) {
+            pool.spawn([this, de, path] { exportFile(de, path); });
+            continue;
+        }
+        if (name == "." || name == "..") continue;
+
+        if (mkdir(path.c_str(), 0755) != 0)
+            throw InvalidOptionException(CANNOT_CREATE_FILE_ERROR);
+        pool.spawn([this, &pool, de, path] { exportDirectory(pool, de.mStartCluster, path); });
+    }
+}
+
 bool OutcpCommand::validateArguments() {
     if (mOptCount != 2) return false;
     pathCheck(mOpt1);
@@ -446,16 +813,56 @@ bool LoadCommand::run() {
     if (!stream.good())
         throw InvalidOptionException(FILE_NOT_FOUND_ERROR);
 
-    std::vector<std::string> args;
-    for (std::string line; getline(stream, line);) {
-        std::cout << line << std::endl;
-        args = split(line, " ");
-        try {
+    if (hasSwitch("--batch")) return runBatch(stream);
+
+    // Script commands are committed to the journal in groups
+    mFS->beginGroupCommit();
+    try {
+        std::vector<std::string> args;
+        for (std::string line; getline(stream, line);) {
+            out() << line << std::endl;
+            args = split(line, " ");
+            try {
+                handleUserInput(args, mFS);
+            } catch (InvalidOptionException &ex) { // ¯\_(ツ)_/¯
+                out() << ex.what() << std::endl;
+            }
+        }
+    } catch (...) {
+        mFS->endGroupCommit();
+        throw;
+    }
+    mFS->endGroupCommit();
+    return true;
+}
+
+/**
+ * All metadata changes of the script are applied at the end at once, first
+ * failing command rolls back the whole script. Nested batch joins the outer one.
+ */
+bool LoadCommand::runBatch(std::ifstream &stream) {
+    bool isOuter = !mFS->isBatch();
+    if (isOuter) mFS->beginBatch();
+    try {
+        std::vector<std::string> args;
+        for (std::string line; getline(stream, line);) {
+            out() << line << std::endl;
+            args = split(line, " ");
+            // a typo must not be skipped, the rest of the script may depend on it
+            if (!args.empty() && getCommandCode(args[0]) == ECommands::eUnknownCommand)
+                throw InvalidOptionException(UNKNOWN_COMMAND_ERROR + ": " + args[0]);
             handleUserInput(args, mFS);
-        } catch (InvalidOptionException &ex) { // ¯\_(ツ)_/¯
-            std::cout << ex.what() << std::endl;
         }
+    } catch (InvalidOptionException &ex) {
+        if (!isOuter) throw;
+        out() << ex.what() << std::endl;
+        mFS->rollbackBatch();
+        throw InvalidOptionException(BATCH_ROLLBACK_ERROR);
+    } catch (...) {
+        if (isOuter) mFS->rollbackBatch();
+        throw;
     }
+    if (isOuter) mFS->endBatch();
     return true;
 }
 
@@ -465,18 +872,20 @@ bool LoadCommand::validateArguments() {
 }
 
 bool FormatCommand::run() {
+    if (mFS->isBatch())
+        throw InvalidOptionException(BATCH_FORMAT_ERROR);
     try {
-        mFS->formatFS(std::stoi(mOpt1));
+        mFS->formatFS(std::stoi(mOpt1), mClusterSize);
     } catch (...) {
         std::cerr << "internal error, couldn't format file system" << std::endl;
         exit(1);
     }
-    std::cout << *mFS << std::endl;
+    out() << *mFS << std::endl;
     return true;
 }
 
 bool FormatCommand::validateArguments() {
-    if (mOptCount != 1) return false;
+    if (mOptCount != 1 && mOptCount != 2) return false;
 
     std::transform(mOpt1.begin(), mOpt1.end(), mOpt1.begin(),
                    [](unsigned char c) { return std::toupper(c); });
@@ -488,12 +897,43 @@ bool FormatCommand::validateArguments() {
 
     mOpt1.erase(pos, ALLOWED_FORMATS[0].length());
 
-    if (!is_number(mOpt1))
+    if (!is_number(mOpt1) || mOpt1.length() > 9)
         throw InvalidOptionException(CANNOT_CREATE_FILE_ERROR + " (not a number)");
 
+    if (mOptCount == 2) mClusterSize = parseClusterSize(mOpt2);
+    auto clusterCount = BootSector::getClusterCount(std::stoi(mOpt1), mClusterSize);
+    if (clusterCount < 1)
+        throw InvalidOptionException(CANNOT_CREATE_FILE_ERROR + " (disk too small)");
+    // cluster numbers have to stay below FAT labels
+    if (clusterCount >= FAT_BAD_CLUSTER)
+        throw InvalidOptionException(CANNOT_CREATE_FILE_ERROR + " (disk too large for cluster size)");
+
     return true;
 }
 
+/**
+ * Parses cluster size with unit (e.g. 64KB), it has to be a power of two
+ * between MIN_CLUSTER_SIZE and MAX_CLUSTER_SIZE.
+ */
+int FormatCommand::parseClusterSize(std::string option) {
+    std::transform(option.begin(), option.end(), option.begin(),
+                   [](unsigned char c) { return std::toupper(c); });
+
+    for (auto &unit: CLUSTER_SIZE_UNITS) {
+        auto pos = option.length() - std::min(option.length(), unit.first.length());
+        if (option.compare(pos, std::string::npos, unit.first) != 0) continue;
+
+        auto number = option.substr(0, pos);
+        if (!is_number(number) || number.length() > 7) break;
+
+        int64_t clusterSize = std::stoll(number) * unit.second;
+        if (clusterSize < MIN_CLUSTER_SIZE || clusterSize > MAX_CLUSTER_SIZE || (clusterSize & (clusterSize - 1)))
+            break;
+        return static_cast<int>(clusterSize);
+    }
+    throw InvalidOptionException(CANNOT_CREATE_FILE_ERROR + " (wrong cluster size)");
+}
+
 bool DefragCommand::run() {
     auto fileDE = mFS->getLastRelativeDirectoryEntry(mAccumulator, EFileOption::FILE);
     mAccumulator.pop_back();
@@ -512,8 +952,8 @@ bool DefragCommand::run() {
 
     // Get data
     auto fileData = mFS->readFile(clusters, fileDE.mSize);
-    // Label previous clusters as free
-    mFS->labelFatClusterChain(clusters, FAT_UNUSED);
+    // Label previous clusters as free, shared clusters stay with the other files (copy-on-write)
+    mFS->releaseFileChain(fileDE);
     // Get new continuous clusters
     clusters = mFS->getFreeClusters(static_cast<int>(clusters.size()), true);
     // Write data
@@ -521,9 +961,9 @@ bool DefragCommand::run() {
     // Chain continuous clusters in FAT tables
     mFS->makeFatChain(clusters);
     // Edit directory entry
-    int oldCluster = fileDE.mStartCluster;
     fileDE.mStartCluster = clusters.at(0);
-    return mFS->editDirectoryEntry(parentDE.mStartCluster, oldCluster, fileDE);
+    fileDE.mIsShared = false;
+    return mFS->editDirectoryEntry(parentDE.mStartCluster, fileDE.mItemName, fileDE);
 }
 
 bool DefragCommand::validateArguments() {
@@ -532,3 +972,14 @@ bool DefragCommand::validateArguments() {
     mAccumulator = split(mOpt1, "/");
     return true;
 }
+
+bool DedupCommand::run() {
+    int freedClusters = mFS->deduplicate();
+    out() << "RECLAIMED " << freedClusters << " clusters ("
+              << static_cast<int64_t>(freedClusters) * mFS->mBootSector.mClusterSize << " B)" << std::endl;
+    return true;
+}
+
+bool DedupCommand::validateArguments() {
+    return mOptCount == 0;
+}
@@ -3,6 +3,10 @@
 
 #include "ICommand.h"
 
+#include <fstream>
+
+class TaskPool;
+
 // FS commands API
 bool handleUserInput(std::vector<std::string> arguments, const std::shared_ptr<FileSystem> &pFS);
 
@@ -10,19 +14,33 @@ bool handleUserInput(std::vector<std::string> arguments, const std::shared_ptr<F
 /**
 Zkopíruje soubor s1 do umístění s2
 cp s1 s2
+S přepínačem --reflink kopie sdílí clustery zdroje (copy-on-write), kopírují se pouze metadata.
+cp --reflink s1 s2
+S přepínačem -r zkopíruje celý adresář a1 jako nový adresář a2.
+cp -r a1 a2
 Možný výsledek:
 OK
 FILE NOT FOUND (není zdroj)
 PATH NOT FOUND (neexistuje cílová cesta)
+EXIST (a2 již existuje)
  */
 class CpCommand : public ICommand {
 public:
     using ICommand::ICommand;
 
 private:
+    struct TreeItem {
+        DirectoryEntry mEntry;
+        int mParent; // index into the directory list, -1 for the copied directory itself
+    };
+
     std::vector<std::string> mAccumulator1;
     std::vector<std::string> mAccumulator2;
 
+    bool isSwitchSupported(const std::string &name) const override { return name == "--reflink" || name == "-r"; }
+
+    bool runRecursive();
+
     bool validateArguments() override;
 
     bool run() override;
@@ -52,9 +70,12 @@ private:
 
 /**
 rm s1
+S přepínačem -r smaže adresář a1 i s celým obsahem, pokud neobsahuje pracovní adresář některé relace.
+rm -r a1
 Možný výsledek:
 OK
 FILE NOT FOUND
+PATH NOT FOUND (neexistující adresář)
  */
 class RmCommand : public ICommand {
 
@@ -64,6 +85,10 @@ public:
 private:
     std::vector<std::string> mAccumulator;
 
+    bool isSwitchSupported(const std::string &name) const override { return name == "-r"; }
+
+    bool runRecursive();
+
     bool validateArguments() override;
 
     bool run() override;
@@ -129,6 +154,8 @@ public:
 private:
     std::vector<std::string> mAccumulator;
 
+    bool isReadOnly() const override { return true; }
+
     bool validateArguments() override;
 
     bool run() override;
@@ -149,6 +176,8 @@ public:
 private:
     std::vector<std::string> mAccumulator;
 
+    bool isReadOnly() const override { return true; }
+
     bool validateArguments() override;
 
     bool run() override;
@@ -186,6 +215,8 @@ public:
     using ICommand::ICommand;
 
 private:
+    bool isReadOnly() const override { return true; }
+
     bool validateArguments() override;
 
     bool run() override;
@@ -207,6 +238,8 @@ public:
 private:
     std::vector<std::string> mAccumulator;
 
+    bool isReadOnly() const override { return true; }
+
     bool validateArguments() override;
 
     bool run() override;
@@ -215,10 +248,15 @@ private:
 /**
 Nahraje soubor s1 z pevného disku do umístění s2 ve vašem FS
 incp s1 s2
+S přepínačem --compress se soubor uloží komprimovaný (po blocích, viz CompressedFile).
+incp --compress s1 s2
+S přepínačem -r nahraje celý adresář a1 jako nový adresář a2, soubory se kopírují paralelně.
+incp -r a1 a2
 Možný výsledek:
 OK
 FILE NOT FOUND (není zdroj)
 PATH NOT FOUND (neexistuje cílová cesta)
+EXIST (a2 již existuje)
  */
 class IncpCommand : public ICommand {
 
@@ -226,8 +264,28 @@ public:
     using ICommand::ICommand;
 
 private:
+    struct HostItem {
+        std::string mHostPath;
+        std::string mName;
+        int mParent; // index into mHostDirectories, -1 for the imported directory itself
+        int64_t mSize;
+    };
+
     std::vector<std::string> mAccumulator;
-    std::vector<char> mBuffer;
+    std::ifstream mHostFile;
+    int64_t mFileSize;
+    std::vector<HostItem> mHostDirectories; // parents precede their children
+    std::vector<HostItem> mHostFiles;
+
+    bool isSwitchSupported(const std::string &name) const override { return name == "--compress" || name == "-r"; }
+
+    int64_t getMaxStoredSize(int64_t fileSize) const;
+
+    void collectHostTree(const std::string &hostPath, const std::string &name, int parent);
+
+    void storeFile(int parentCluster, const std::string &fileName, std::ifstream &stream, int64_t fileSize);
+
+    bool runRecursive();
 
     bool validateArguments() override;
 
@@ -237,10 +295,13 @@ private:
 /**
 Nahraje soubor s1 z vašeho FS do umístění s2 na pevném disku
 outcp s1 s2
+S přepínačem -r nahraje celý adresář a1 jako nový adresář a2 na pevném disku, soubory paralelně.
+outcp -r a1 a2
 Možný výsledek:
 OK
 FILE NOT FOUND (není zdroj)
 PATH NOT FOUND (neexistuje cílová cesta)
+EXIST (a2 již existuje)
  */
 class OutcpCommand : public ICommand {
 
@@ -250,6 +311,16 @@ public:
 private:
     std::vector<std::string> mAccumulator;
 
+    bool isReadOnly() const override { return true; }
+
+    bool isSwitchSupported(const std::string &name) const override { return name == "-r"; }
+
+    void exportFile(const DirectoryEntry &de, const std::string &hostPath);
+
+    void exportDirectory(TaskPool &pool, int cluster, const std::string &hostPath);
+
+    bool runRecursive();
+
     bool validateArguments() override;
 
     bool run() override;
@@ -262,6 +333,13 @@ load s1
 Možný výsledek:
 OK
 FILE NOT FOUND (není zdroj)
+
+Přepínač --batch provede změny metadat celého skriptu najednou až na jeho konci,
+při chybě kteréhokoliv příkazu se skript vrátí do původního stavu.
+load --batch s1
+Možný výsledek:
+OK
+batch failed, changes rolled back
  */
 class LoadCommand : public ICommand {
 
@@ -269,9 +347,13 @@ public:
     using ICommand::ICommand;
 
 private:
+    bool isSwitchSupported(const std::string &name) const override { return name == "--batch"; }
+
     bool validateArguments() override;
 
     bool run() override;
+
+    bool runBatch(std::ifstream &stream);
 };
 
 /**
@@ -282,6 +364,9 @@ format 600MB
 Možný výsledek:
 OK
 CANNOT CREATE FILE
+
+Volitelný druhý parametr určuje velikost clusteru (mocnina dvou od 1KB do 1MB, výchozí 4KB).
+format 600MB 64KB
  */
 class FormatCommand : public ICommand {
 
@@ -289,10 +374,13 @@ public:
     using ICommand::ICommand;
 
 private:
+    int mClusterSize = DEFAULT_CLUSTER_SIZE;
 
     bool validateArguments() override;
 
     bool run() override;
+
+    static int parseClusterSize(std::string option);
 };
 
 /**
@@ -314,5 +402,24 @@ private:
     bool run() override;
 };
 
+/**
+Deduplikace – najde soubory se shodným obsahem a sloučí je do jednoho sdíleného řetězu
+clusterů (viz cp --reflink), vypíše počet uvolněných clusterů.
+dedup
+Možný výsledek:
+RECLAIMED 12 clusters (49152 B)
+OK
+ */
+class DedupCommand : public ICommand {
+
+public:
+    using ICommand::ICommand;
+
+private:
+    bool validateArguments() override;
+
+    bool run() override;
+};
+
 
 #endif //ZOS_SP_COMMANDS_H
@@ -0,0 +1,52 @@
+#include "CompressedFile.h"
+#include "definitions.h"
+
+#include <cstring>
+#include <stdexcept>
+
+CompressedFile::CompressedFile(uint64_t originalSize) :
+        mOriginalSize(originalSize), mChunks((originalSize + CHUNK_SIZE - 1) / CHUNK_SIZE, 0) {}
+
+CompressedFile CompressedFile::fromHeader(const char *header) {
+    uint32_t fields[2];
+    memcpy(fields, header, HEADER_SIZE);
+
+    // all chunks but the last one are full, CHUNK_SIZE divides 2^32 so the low bits give the last one
+    uint64_t originalSize = 0;
+    if (fields[1]) originalSize = (fields[1] - 1ull) * CHUNK_SIZE + (fields[0] - 1u) % CHUNK_SIZE + 1;
+
+    CompressedFile file{originalSize};
+    if (static_cast<uint32_t>(originalSize) != fields[0] || fields[1] != file.chunkCount())
+        throw std::runtime_error(CORRUPTED_FS_ERROR);
+    return file;
+}
+
+void CompressedFile::readTable(const char *table) {
+    memcpy(mChunks.data(), table, mChunks.size() * sizeof(uint32_t));
+}
+
+uint32_t CompressedFile::chunkSize(size_t chunk) const {
+    return chunk + 1 < mChunks.size() ? CHUNK_SIZE : static_cast<uint32_t>(mOriginalSize - CHUNK_SIZE * chunk);
+}
+
+void CompressedFile::setChunk(size_t chunk, uint32_t storedSize, bool raw) {
+    mChunks[chunk] = storedSize | (raw ? RAW_CHUNK : 0);
+}
+
+int64_t CompressedFile::seal() {
+    mOffsets.resize(mChunks.size());
+    int64_t offset = tableSize();
+    for (size_t i = 0; i < mChunks.size(); i++) {
+        mOffsets[i] = offset;
+        offset += storedSize(i);
+    }
+    return offset;
+}
+
+std::vector<char> CompressedFile::serializeTable() const {
+    std::vector<char> table(tableSize());
+    uint32_t header[2] = {static_cast<uint32_t>(mOriginalSize), static_cast<uint32_t>(mChunks.size())};
+    memcpy(table.data(), header, HEADER_SIZE);
+    memcpy(table.data() + HEADER_SIZE, mChunks.data(), mChunks.size() * sizeof(uint32_t));
+    return table;
+}
@@ -0,0 +1,69 @@
+#ifndef ZOS_SP_COMPRESSEDFILE_H
+#define ZOS_SP_COMPRESSEDFILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Layout of compressed file data. File is split into chunks of CHUNK_SIZE
+ * bytes compressed independently, so any chunk can be read without
+ * decompressing the ones before it.
+ *
+ * HEADER (original size modulo 2^32, chunk count), the size is completed
+ *        from chunk count, so the header is the same for 32-bit sizes
+ * CHUNK TABLE (stored size of each chunk, RAW_CHUNK bit = chunk didn't compress and is stored as is)
+ * CHUNKS
+ */
+class CompressedFile {
+private:
+    uint64_t mOriginalSize;
+    std::vector<uint32_t> mChunks;
+    std::vector<int64_t> mOffsets; // data offset of each chunk, computed by seal()
+
+public:
+    static const uint32_t CHUNK_SIZE = 1 << 16;
+    static const uint32_t RAW_CHUNK = 1u << 31;
+    static const size_t HEADER_SIZE = sizeof(uint32_t) * 2;
+
+    explicit CompressedFile(uint64_t originalSize);
+
+    /**
+     * Creates layout from serialized header, throws std::runtime_error if it's malformed.
+     */
+    static CompressedFile fromHeader(const char *header);
+
+    /**
+     * Loads serialized chunk table (without header).
+     */
+    void readTable(const char *table);
+
+    uint64_t originalSize() const { return mOriginalSize; }
+
+    size_t chunkCount() const { return mChunks.size(); }
+
+    /**
+     * @return Size of header and chunk table, i.e. offset of the first chunk.
+     */
+    size_t tableSize() const { return HEADER_SIZE + mChunks.size() * sizeof(uint32_t); }
+
+    uint32_t chunkSize(size_t chunk) const;
+
+    uint32_t storedSize(size_t chunk) const { return mChunks[chunk] & ~RAW_CHUNK; }
+
+    bool isRaw(size_t chunk) const { return mChunks[chunk] & RAW_CHUNK; }
+
+    int64_t chunkOffset(size_t chunk) const { return mOffsets[chunk]; }
+
+    void setChunk(size_t chunk, uint32_t storedSize, bool raw);
+
+    /**
+     * Computes chunk offsets.
+     * @return Size of whole stored data.
+     */
+    int64_t seal();
+
+    std::vector<char> serializeTable() const;
+};
+
+#endif //ZOS_SP_COMPRESSEDFILE_H
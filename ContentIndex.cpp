@@ -0,0 +1,31 @@
+#include "ContentIndex.h"
+
+uint64_t ContentIndex::key(uint64_t contentHash, int64_t size) {
+    return contentHash ^ (static_cast<uint64_t>(size) * 0x9e3779b97f4a7c15ull);
+}
+
+void ContentIndex::insert(uint64_t key, const Location &location) {
+    mLocations.emplace(key, location);
+}
+
+std::vector<ContentIndex::Location> ContentIndex::find(uint64_t key) const {
+    std::vector<Location> locations{};
+    auto range = mLocations.equal_range(key);
+    for (auto it = range.first; it != range.second; it++) locations.push_back(it->second);
+    return locations;
+}
+
+void ContentIndex::erase(uint64_t key, const Location &location) {
+    auto range = mLocations.equal_range(key);
+    for (auto it = range.first; it != range.second; it++) {
+        if (it->second.mParentCluster == location.mParentCluster && it->second.mItemName == location.mItemName) {
+            mLocations.erase(it);
+            return;
+        }
+    }
+}
+
+void ContentIndex::clear() {
+    mLocations.clear();
+    mBuilt = false;
+}
@@ -0,0 +1,44 @@
+#ifndef ZOS_SP_CONTENTINDEX_H
+#define ZOS_SP_CONTENTINDEX_H
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Index of file contents for deduplication, content hash and size -> files
+ * with such content. Built lazily from all files of the image and kept in
+ * memory, locations may go stale (mv, rm), so FileSystem checks them against
+ * the directory before use and erases the stale ones.
+ */
+class ContentIndex {
+public:
+    struct Location {
+        int mParentCluster;
+        std::string mItemName;
+        int mStartCluster;
+    };
+
+private:
+    std::unordered_multimap<uint64_t, Location> mLocations;
+    bool mBuilt = false;
+
+public:
+    static uint64_t key(uint64_t contentHash, int64_t size);
+
+    bool isBuilt() const { return mBuilt; }
+
+    void markBuilt() { mBuilt = true; }
+
+    void insert(uint64_t key, const Location &location);
+
+    std::vector<Location> find(uint64_t key) const;
+
+    void erase(uint64_t key, const Location &location);
+
+    void clear();
+};
+
+
+#endif //ZOS_SP_CONTENTINDEX_H
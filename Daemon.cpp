@@ -0,0 +1,297 @@
+#include "Daemon.h"
+#include "Commands.h"
+#include "definitions.h"
+#include "utils/string-utils.h"
+
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+Daemon::Daemon(const std::shared_ptr<FileSystem> &pFS, std::string socketPath, int workerCount) :
+        mFS(pFS), mSocketPath(std::move(socketPath)) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (mSocketPath.empty() || mSocketPath.size() >= sizeof(address.sun_path))
+        throw std::runtime_error(DAEMON_SOCKET_ERROR);
+    std::strcpy(address.sun_path, mSocketPath.c_str());
+
+    // workers inherit the mask, signals are only received through the signalfd
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, &mPreviousSignalMask);
+
+    try {
+        mListenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (mListenFd < 0)
+            throw std::runtime_error(DAEMON_SOCKET_ERROR);
+        unlink(mSocketPath.c_str()); // stale socket of a previous run
+        if (bind(mListenFd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0
+            || listen(mListenFd, LISTEN_BACKLOG) != 0)
+            throw std::runtime_error(DAEMON_SOCKET_ERROR);
+
+        mEpollFd = epoll_create1(EPOLL_CLOEXEC);
+        mWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        mSignalFd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (mEpollFd < 0 || mWakeFd < 0 || mSignalFd < 0)
+            throw std::runtime_error(DAEMON_EVENT_ERROR);
+        watch(mListenFd);
+        watch(mWakeFd);
+        watch(mSignalFd);
+    } catch (...) {
+        release();
+        throw;
+    }
+
+    for (int i = 0; i < workerCount; i++) {
+        mWorkers.emplace_back(&Daemon::work, this);
+    }
+}
+
+Daemon::~Daemon() {
+    {
+        std::lock_guard<std::mutex> lock(mJobMutex);
+        mStopping = true;
+    }
+    mJobReady.notify_all();
+    for (auto &it: mWorkers) {
+        it.join();
+    }
+
+    for (auto &it: mConnections) {
+        close(it.first);
+        mFS->closeSession(it.second->mSession);
+    }
+    release();
+}
+
+void Daemon::release() {
+    for (auto fd: {mListenFd, mEpollFd, mWakeFd, mSignalFd}) {
+        if (fd >= 0) close(fd);
+    }
+    if (mListenFd >= 0) unlink(mSocketPath.c_str());
+    mListenFd = mEpollFd = mWakeFd = mSignalFd = -1;
+    pthread_sigmask(SIG_SETMASK, &mPreviousSignalMask, nullptr);
+}
+
+void Daemon::watch(int fd) {
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, fd, &event) != 0)
+        throw std::runtime_error(DAEMON_EVENT_ERROR);
+}
+
+/**
+ * Connections without events are removed from the epoll set, a closed peer
+ * would keep reporting EPOLLHUP otherwise.
+ */
+void Daemon::watch(Connection &connection, uint32_t events) {
+    if (events == connection.mEvents) return;
+
+    epoll_event event{};
+    event.events = events;
+    event.data.fd = connection.mFd;
+    int operation = !events ? EPOLL_CTL_DEL : connection.mEvents ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(mEpollFd, operation, connection.mFd, &event) != 0)
+        throw std::runtime_error(DAEMON_EVENT_ERROR);
+    connection.mEvents = events;
+}
+
+void Daemon::run() {
+    epoll_event events[MAX_EVENTS];
+    while (true) {
+        int count = epoll_wait(mEpollFd, events, MAX_EVENTS, -1);
+        if (count < 0 && errno == EINTR) continue;
+        if (count < 0)
+            throw std::runtime_error(DAEMON_EVENT_ERROR);
+
+        for (int i = 0; i < count; i++) {
+            int fd = events[i].data.fd;
+            if (fd == mSignalFd) return;
+            if (fd == mListenFd) {
+                acceptConnections();
+                continue;
+            }
+            if (fd == mWakeFd) {
+                collectResults();
+                continue;
+            }
+
+            auto it = mConnections.find(fd);
+            if (it == mConnections.end()) continue; // closed by an earlier event
+            auto connection = it->second;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR) && !connection->mClosing)
+                receive(connection);
+            if (events[i].events & EPOLLOUT || connection->mClosing)
+                flushOutput(connection);
+        }
+    }
+}
+
+void Daemon::acceptConnections() {
+    while (true) {
+        int fd = accept4(mListenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0 && errno == EINTR) continue;
+        if (fd < 0) return; // EAGAIN, or out of descriptors until a client leaves
+
+        auto connection = std::make_shared<Connection>();
+        connection->mFd = fd;
+        mFS->openSession(connection->mSession);
+        mConnections[fd] = connection;
+        watch(*connection, EPOLLIN);
+    }
+}
+
+/**
+ * Reads whatever the client sent and queues complete lines as commands. End
+ * of input also ends a last unterminated line.
+ */
+void Daemon::receive(const std::shared_ptr<Connection> &connection) {
+    char buffer[READ_SIZE];
+    while (true) {
+        auto count = read(connection->mFd, buffer, sizeof(buffer));
+        if (count < 0 && errno == EINTR) continue;
+        if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (count <= 0) {
+            connection->mClosing = true;
+            break;
+        }
+        connection->mInput.append(buffer, static_cast<size_t>(count));
+    }
+
+    size_t start = 0;
+    for (size_t end; (end = connection->mInput.find('\n', start)) != std::string::npos; start = end + 1) {
+        auto line = connection->mInput.substr(start, end - start);
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        connection->mCommands.push_back(std::move(line));
+    }
+    connection->mInput.erase(0, start);
+    if (connection->mClosing && !connection->mInput.empty()) {
+        connection->mCommands.push_back(std::move(connection->mInput));
+        connection->mInput.clear();
+    }
+    dispatch(connection);
+}
+
+void Daemon::dispatch(const std::shared_ptr<Connection> &connection) {
+    if (connection->mBusy || connection->mCommands.empty()) return;
+
+    connection->mBusy = true;
+    {
+        std::lock_guard<std::mutex> lock(mJobMutex);
+        mJobs.push_back({connection, std::move(connection->mCommands.front())});
+    }
+    connection->mCommands.pop_front();
+    mJobReady.notify_one();
+}
+
+void Daemon::collectResults() {
+    uint64_t counter;
+    while (read(mWakeFd, &counter, sizeof(counter)) > 0);
+
+    std::deque<Result> results;
+    {
+        std::lock_guard<std::mutex> lock(mResultMutex);
+        results.swap(mResults);
+    }
+    for (auto &it: results) {
+        auto &connection = it.mConnection;
+        connection->mBusy = false;
+        connection->mOutput += it.mOutput;
+        connection->mOutput += RESPONSE_END;
+        if (it.mExit) {
+            connection->mClosing = true;
+            connection->mCommands.clear();
+        }
+        dispatch(connection);
+        flushOutput(connection);
+    }
+}
+
+/**
+ * Writes pending responses without blocking, the rest waits for EPOLLOUT.
+ * Closes the connection once it is finished.
+ */
+void Daemon::flushOutput(const std::shared_ptr<Connection> &connection) {
+    auto &output = connection->mOutput;
+    size_t written = 0;
+    while (written < output.size()) {
+        auto count = send(connection->mFd, output.data() + written, output.size() - written, MSG_NOSIGNAL);
+        if (count < 0 && errno == EINTR) continue;
+        if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (count < 0) {
+            // client is gone, drop its output and queued commands
+            written = output.size();
+            connection->mClosing = true;
+            connection->mCommands.clear();
+            break;
+        }
+        written += static_cast<size_t>(count);
+    }
+    output.erase(0, written);
+
+    if (connection->mClosing && !connection->mBusy && connection->mCommands.empty() && output.empty()) {
+        closeConnection(connection);
+        return;
+    }
+    uint32_t events = connection->mClosing ? 0u : static_cast<uint32_t>(EPOLLIN);
+    if (!output.empty()) events |= EPOLLOUT;
+    watch(*connection, events);
+}
+
+void Daemon::closeConnection(const std::shared_ptr<Connection> &connection) {
+    watch(*connection, 0);
+    close(connection->mFd);
+    mFS->closeSession(connection->mSession);
+    mConnections.erase(connection->mFd);
+}
+
+void Daemon::work() {
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mJobMutex);
+            mJobReady.wait(lock, [this] { return mStopping || !mJobs.empty(); });
+            if (mStopping) return;
+            job = std::move(mJobs.front());
+            mJobs.pop_front();
+        }
+
+        bool exit = false;
+        auto output = execute(*job.mConnection, job.mCommand, exit);
+        {
+            std::lock_guard<std::mutex> lock(mResultMutex);
+            mResults.push_back({job.mConnection, std::move(output), exit});
+        }
+        uint64_t one = 1;
+        write(mWakeFd, &one, sizeof(one));
+    }
+}
+
+/**
+ * Runs one command line in the session of the connection, same as the
+ * console does.
+ * @param exit Set when the client asked to end the session.
+ * @return Output of the command.
+ */
+std::string Daemon::execute(Connection &connection, const std::string &command, bool &exit) {
+    std::ostringstream output;
+    connection.mSession.mOut = &output;
+    FileSystem::SessionScope scope(connection.mSession);
+    try {
+        exit = !handleUserInput(split(command, " "), mFS);
+    } catch (std::exception &ex) {
+        // internal errors are reported too, one client must not stop the others
+        output << "fs: " << ex.what() << std::endl;
+    }
+    return output.str();
+}
@@ -0,0 +1,109 @@
+#ifndef ZOS_SP_DAEMON_H
+#define ZOS_SP_DAEMON_H
+
+#include "FileSystem.h"
+#include "Session.h"
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <signal.h>
+
+/**
+ * Serves the command set of a mounted fs to local clients over a Unix domain
+ * socket. A single epoll loop accepts connections and reads commands (one per
+ * line), a pool of workers runs them. Every connection is a session with its
+ * own working directory, its commands run one at a time in the order they
+ * were received and each response ends with RESPONSE_END.
+ */
+class Daemon {
+public:
+    static const char RESPONSE_END = '\0';
+
+private:
+    static const int LISTEN_BACKLOG = 128;
+    static const int MAX_EVENTS = 64;
+    static const size_t READ_SIZE = 64 * 1024;
+
+    struct Connection {
+        int mFd;
+        Session mSession;
+        std::string mInput; // received bytes not forming a whole line yet
+        std::deque<std::string> mCommands; // waiting for the running command of the connection
+        std::string mOutput; // responses not written to the socket yet
+        uint32_t mEvents = 0; // epoll events the connection is watched for, 0 = not watched
+        bool mBusy = false; // a worker runs a command of the connection
+        bool mClosing = false; // close once all commands are answered (exit, end of input)
+    };
+
+    struct Job {
+        std::shared_ptr<Connection> mConnection;
+        std::string mCommand;
+    };
+
+    struct Result {
+        std::shared_ptr<Connection> mConnection;
+        std::string mOutput;
+        bool mExit;
+    };
+
+    std::shared_ptr<FileSystem> mFS;
+    const std::string mSocketPath;
+    int mListenFd = -1;
+    int mEpollFd = -1;
+    int mWakeFd = -1; // eventfd, workers signal finished jobs
+    int mSignalFd = -1; // SIGINT and SIGTERM stop the daemon
+    sigset_t mPreviousSignalMask{};
+    std::map<int, std::shared_ptr<Connection>> mConnections;
+
+    std::vector<std::thread> mWorkers;
+    std::mutex mJobMutex;
+    std::condition_variable mJobReady;
+    std::deque<Job> mJobs;
+    bool mStopping = false;
+    std::mutex mResultMutex;
+    std::deque<Result> mResults;
+
+    void watch(int fd);
+
+    void watch(Connection &connection, uint32_t events);
+
+    void release();
+
+    void acceptConnections();
+
+    void receive(const std::shared_ptr<Connection> &connection);
+
+    void dispatch(const std::shared_ptr<Connection> &connection);
+
+    void collectResults();
+
+    void flushOutput(const std::shared_ptr<Connection> &connection);
+
+    void closeConnection(const std::shared_ptr<Connection> &connection);
+
+    void work();
+
+    std::string execute(Connection &connection, const std::string &command, bool &exit);
+
+public:
+    Daemon(const std::shared_ptr<FileSystem> &pFS, std::string socketPath, int workerCount);
+
+    ~Daemon();
+
+    Daemon(const Daemon &) = delete;
+
+    Daemon &operator=(const Daemon &) = delete;
+
+    /**
+     * Serves clients until SIGINT or SIGTERM.
+     */
+    void run();
+};
+
+
+#endif //ZOS_SP_DAEMON_H
@@ -0,0 +1,72 @@
+#include "DentryCache.h"
+
+std::string DentryCache::makeKey(const std::string &itemName, EFileOption option) {
+    // names are \00 padded, key is the name itself followed by the option
+    std::string key{itemName.c_str()};
+    key.push_back(static_cast<char>('0' + static_cast<int>(option)));
+    return key;
+}
+
+/**
+ * The cache is dropped as a whole once it grows over its limit, entries are
+ * cheap to re-read compared to tracking their age.
+ */
+void DentryCache::reserveSlot() {
+    if (mEntryCount >= MAX_CACHED_ENTRIES) clear();
+}
+
+ELookupResult DentryCache::lookup(int parentCluster, const std::string &itemName, EFileOption option,
+                                  DirectoryEntry &de) const {
+    auto dir = mDirectories.find(parentCluster);
+    if (dir == mDirectories.end()) return ELookupResult::MISS;
+
+    auto it = dir->second.mByName.find(makeKey(itemName, option));
+    if (it == dir->second.mByName.end()) return ELookupResult::MISS;
+    if (!it->second.mExists) return ELookupResult::NOT_FOUND;
+
+    de = it->second.mEntry;
+    return ELookupResult::FOUND;
+}
+
+ELookupResult DentryCache::lookup(int parentCluster, int childCluster, DirectoryEntry &de) const {
+    auto dir = mDirectories.find(parentCluster);
+    if (dir == mDirectories.end()) return ELookupResult::MISS;
+
+    auto it = dir->second.mByCluster.find(childCluster);
+    if (it == dir->second.mByCluster.end()) return ELookupResult::MISS;
+
+    de = it->second;
+    return ELookupResult::FOUND;
+}
+
+/**
+ * @param de Found entry, nullptr caches a negative result.
+ */
+void DentryCache::insert(int parentCluster, const std::string &itemName, EFileOption option,
+                         const DirectoryEntry *de) {
+    reserveSlot();
+    auto inserted = mDirectories[parentCluster].mByName.emplace(makeKey(itemName, option), CachedEntry{});
+    if (inserted.second) mEntryCount++;
+    auto &entry = inserted.first->second;
+    entry.mExists = de != nullptr;
+    if (de) entry.mEntry = *de;
+}
+
+void DentryCache::insert(int parentCluster, int childCluster, const DirectoryEntry &de) {
+    reserveSlot();
+    auto inserted = mDirectories[parentCluster].mByCluster.emplace(childCluster, de);
+    if (inserted.second) mEntryCount++;
+    else inserted.first->second = de;
+}
+
+void DentryCache::invalidate(int parentCluster) {
+    auto dir = mDirectories.find(parentCluster);
+    if (dir == mDirectories.end()) return;
+    mEntryCount -= dir->second.mByName.size() + dir->second.mByCluster.size();
+    mDirectories.erase(dir);
+}
+
+void DentryCache::clear() {
+    mDirectories.clear();
+    mEntryCount = 0;
+}
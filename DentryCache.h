@@ -0,0 +1,55 @@
+#ifndef ZOS_SP_DENTRYCACHE_H
+#define ZOS_SP_DENTRYCACHE_H
+
+#include "DirectoryEntry.h"
+#include <unordered_map>
+
+enum class ELookupResult {
+    MISS,
+    FOUND,
+    NOT_FOUND, // cached negative entry
+};
+
+/**
+ * Caches directory entry lookups keyed by (parent cluster, name, file option)
+ * and (parent cluster, child cluster), including negative results for name
+ * lookups. Whole parent directories are invalidated whenever their cluster
+ * is written.
+ */
+class DentryCache {
+private:
+    static const size_t MAX_CACHED_ENTRIES = 1 << 16;
+
+    struct CachedEntry {
+        bool mExists;
+        DirectoryEntry mEntry;
+    };
+
+    struct Directory {
+        std::unordered_map<std::string, CachedEntry> mByName;
+        std::unordered_map<int, DirectoryEntry> mByCluster;
+    };
+
+    std::unordered_map<int, Directory> mDirectories;
+    size_t mEntryCount = 0;
+
+    static std::string makeKey(const std::string &itemName, EFileOption option);
+
+    void reserveSlot();
+
+public:
+    ELookupResult lookup(int parentCluster, const std::string &itemName, EFileOption option, DirectoryEntry &de) const;
+
+    ELookupResult lookup(int parentCluster, int childCluster, DirectoryEntry &de) const;
+
+    void insert(int parentCluster, const std::string &itemName, EFileOption option, const DirectoryEntry *de);
+
+    void insert(int parentCluster, int childCluster, const DirectoryEntry &de);
+
+    void invalidate(int parentCluster);
+
+    void clear();
+};
+
+
+#endif //ZOS_SP_DENTRYCACHE_H
@@ -1,14 +1,17 @@
 #include "DirectoryEntry.h"
-#include "utils/stream-utils.h"
 
-DirectoryEntry::DirectoryEntry(const std::string &&itemName, bool mIsFile, int mSize, int mStartCluster) :
+#include <cstddef>
+#include <ostream>
+#include <stdexcept>
+
+DirectoryEntry::DirectoryEntry(const std::string &&itemName, bool mIsFile, int64_t mSize, int mStartCluster) :
         mIsFile(mIsFile), mSize(mSize), mStartCluster(mStartCluster) {
     if (itemName.length() >= ITEM_NAME_LENGTH)
         throw std::runtime_error(DE_ITEM_NAME_LENGTH_ERROR);
     mItemName = itemName + std::string(ITEM_NAME_LENGTH - itemName.length(), '\00');
 }
 
-DirectoryEntry::DirectoryEntry(const std::string &itemName, bool mIsFile, int mSize, int mStartCluster) :
+DirectoryEntry::DirectoryEntry(const std::string &itemName, bool mIsFile, int64_t mSize, int mStartCluster) :
         mIsFile(mIsFile), mSize(mSize), mStartCluster(mStartCluster) {
     if (itemName.length() >= ITEM_NAME_LENGTH) {
         throw std::runtime_error(DE_ITEM_NAME_LENGTH_ERROR);
@@ -16,18 +19,66 @@ DirectoryEntry::DirectoryEntry(const std::string &itemName, bool mIsFile, int mS
     mItemName = itemName + std::string(ITEM_NAME_LENGTH - itemName.length(), '\00');
 }
 
-void DirectoryEntry::write(std::fstream &f) {
-    writeToStream(f, mItemName, ITEM_NAME_LENGTH);
-    writeToStream(f, mIsFile);
-    writeToStream(f, mSize);
-    writeToStream(f, mStartCluster);
+DirectoryEntry::DirectoryEntry(const DirectoryEntryRecord &record) :
+        mItemName(record.mItemName, ITEM_NAME_LENGTH), mIsFile(record.isFile()), mIsShared(record.isShared()),
+        mIsCompressed(record.isCompressed()), mSize(record.mSize), mStartCluster(record.mStartCluster) {}
+
+DirectoryEntryRecord DirectoryEntry::toRecord() const {
+    DirectoryEntryRecord record{};
+    strncpy(record.mItemName, mItemName.c_str(), ITEM_NAME_LENGTH);
+    record.mFlags = (mIsFile ? DirectoryEntryRecord::FLAG_FILE : 0)
+                    | (mIsShared ? DirectoryEntryRecord::FLAG_SHARED : 0)
+                    | (mIsCompressed ? DirectoryEntryRecord::FLAG_COMPRESSED : 0);
+    record.mSize = mSize;
+    record.mStartCluster = mStartCluster;
+    return record;
+}
+
+int DirectoryEntry::getRecordSize(int version) {
+    return version >= 3 ? SIZE : LEGACY_SIZE;
+}
+
+void DirectoryEntry::storeRecord(const DirectoryEntryRecord &record, char *data, int version) {
+    if (version >= 3) {
+        memcpy(data, &record, SIZE);
+        return;
+    }
+
+    if (record.mSize > INT32_MAX)
+        throw std::runtime_error(FILE_SIZE_ERROR);
+    auto size = static_cast<int32_t>(record.mSize);
+    memcpy(data, &record, offsetof(DirectoryEntryRecord, mSize));
+    memcpy(data + offsetof(DirectoryEntryRecord, mSize), &size, sizeof(size));
+    memcpy(data + offsetof(DirectoryEntryRecord, mSize) + sizeof(size), &record.mStartCluster,
+           sizeof(record.mStartCluster));
+}
+
+DirectoryEntryRecord DirectoryEntry::loadRecord(const char *data, int version) {
+    DirectoryEntryRecord record{};
+    if (version >= 3) {
+        memcpy(&record, data, SIZE);
+        return record;
+    }
+
+    int32_t size;
+    memcpy(&record, data, offsetof(DirectoryEntryRecord, mSize));
+    memcpy(&size, data + offsetof(DirectoryEntryRecord, mSize), sizeof(size));
+    memcpy(&record.mStartCluster, data + offsetof(DirectoryEntryRecord, mSize) + sizeof(size),
+           sizeof(record.mStartCluster));
+    record.mSize = size;
+    return record;
+}
+
+void DirectoryEntry::write(IStorage &f, int version) {
+    char data[SIZE];
+    storeRecord(toRecord(), data, version);
+    f.write(data, getRecordSize(version));
 }
 
-void DirectoryEntry::read(std::fstream &f) {
-    readFromStream(f, mItemName, ITEM_NAME_LENGTH);
-    readFromStream(f, mIsFile);
-    readFromStream(f, mSize);
-    readFromStream(f, mStartCluster);
+void DirectoryEntry::read(IStorage &f, int version) {
+    char data[SIZE];
+    f.read(data, getRecordSize(version));
+    *this = DirectoryEntry(loadRecord(data, version));
 }
 
 std::ostream &operator<<(std::ostream &os, DirectoryEntry const &di) {
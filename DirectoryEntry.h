@@ -2,28 +2,82 @@
 #define ZOS_SP_DIRECTORYENTRY_H
 
 #include "definitions.h"
+#include "IStorage.h"
+
+#include <cstring>
+#include <type_traits>
+
+/**
+ * On-disk layout of a directory entry (version 3+), trivially copyable so
+ * a whole directory cluster can be read into an array of records in one I/O.
+ */
+#pragma pack(push, 1)
+struct DirectoryEntryRecord {
+    static const uint8_t FLAG_FILE = 0x01;
+    static const uint8_t FLAG_SHARED = 0x02; // cluster chain is referenced by other entries too
+    static const uint8_t FLAG_COMPRESSED = 0x04; // data are stored in CompressedFile layout
+
+    char mItemName[ITEM_NAME_LENGTH];
+    uint8_t mFlags;
+    int64_t mSize;
+    int32_t mStartCluster;
+
+    bool isAllocated() const { return mItemName[0] != '\00'; }
+
+    bool isFile() const { return mFlags & FLAG_FILE; }
+
+    bool isShared() const { return mFlags & FLAG_SHARED; }
+
+    bool isCompressed() const { return mFlags & FLAG_COMPRESSED; }
+
+    bool hasName(const std::string &itemName) const {
+        return !strncmp(mItemName, itemName.c_str(), ITEM_NAME_LENGTH);
+    }
+};
+#pragma pack(pop)
+
+static_assert(std::is_trivially_copyable<DirectoryEntryRecord>::value, "record must be trivially copyable");
 
 class DirectoryEntry {
 public:
     std::string mItemName;
     bool mIsFile;
-    int mSize;
+    bool mIsShared = false;
+    bool mIsCompressed = false;
+    int64_t mSize; // stored size, original size of compressed file is in its header
     int mStartCluster;
 
     DirectoryEntry(){}
 
-    DirectoryEntry(const std::string &&mItemName, bool mIsFile, int mSize, int mStartCluster);
+    DirectoryEntry(const std::string &&mItemName, bool mIsFile, int64_t mSize, int mStartCluster);
+
+    DirectoryEntry(const std::string &mItemName, bool mIsFile, int64_t mSize, int mStartCluster);
+
+    explicit DirectoryEntry(const DirectoryEntryRecord &record);
+
+    static const int SIZE = ITEM_NAME_LENGTH + sizeof(uint8_t) + sizeof(mSize) + sizeof(mStartCluster);
+
+    // entry size before version 3, file size is 32-bit
+    static const int LEGACY_SIZE = ITEM_NAME_LENGTH + sizeof(uint8_t) + sizeof(int32_t) + sizeof(mStartCluster);
+
+    static int getRecordSize(int version);
+
+    /**
+     * Serializes record in the entry layout of given fs version.
+     */
+    static void storeRecord(const DirectoryEntryRecord &record, char *data, int version);
 
-    DirectoryEntry(const std::string &mItemName, bool mIsFile, int mSize, int mStartCluster);
+    static DirectoryEntryRecord loadRecord(const char *data, int version);
 
-    static const int SIZE = ITEM_NAME_LENGTH + sizeof(mIsFile) + sizeof(mSize) + sizeof(mStartCluster);
+    DirectoryEntryRecord toRecord() const;
 
-    void write(std::fstream &f);
+    void write(IStorage &f, int version = FS_VERSION);
 
-    void read(std::fstream &f);
+    void read(IStorage &f, int version = FS_VERSION);
 
     friend std::ostream &operator<<(std::ostream &os, DirectoryEntry const &fs);
 };
 
+static_assert(sizeof(DirectoryEntryRecord) == DirectoryEntry::SIZE, "record must match on-disk entry size");
 
 #endif //ZOS_SP_DIRECTORYENTRY_H
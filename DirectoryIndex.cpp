@@ -0,0 +1,89 @@
+#include "DirectoryIndex.h"
+
+std::string DirectoryIndex::Directory::key(const DirectoryEntryRecord &record) {
+    return std::string{record.mItemName, strnlen(record.mItemName, ITEM_NAME_LENGTH)};
+}
+
+DirectoryIndex::Directory::Directory(std::vector<int> &&clusters, std::vector<DirectoryEntryRecord> &&entries) :
+        mClusters(std::move(clusters)), mEntries(std::move(entries)) {
+    mSlots.reserve(mEntries.size());
+    for (int i = 0; i < size(); i++) {
+        mSlots.emplace(key(mEntries[i]), i);
+    }
+}
+
+int DirectoryIndex::Directory::find(const std::string &itemName, EFileOption option) const {
+    auto range = mSlots.equal_range(itemName.c_str());
+    int found = -1;
+    for (auto it = range.first; it != range.second; ++it) {
+        auto &record = mEntries[it->second];
+        if (option == EFileOption::FILE && !record.isFile()) continue;
+        if (option == EFileOption::DIRECTORY && record.isFile()) continue;
+        if (found < 0 || it->second < found) found = it->second;
+    }
+    return found;
+}
+
+int DirectoryIndex::Directory::findByCluster(int childCluster) const {
+    for (int i = 0; i < size(); i++) {
+        if (mEntries[i].mStartCluster == childCluster) return i;
+    }
+    return -1;
+}
+
+void DirectoryIndex::Directory::append(const DirectoryEntryRecord &record) {
+    mEntries.push_back(record);
+    mSlots.emplace(key(record), size() - 1);
+}
+
+void DirectoryIndex::Directory::unlink(int slot) {
+    auto range = mSlots.equal_range(key(mEntries[slot]));
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second == slot) {
+            mSlots.erase(it);
+            return;
+        }
+    }
+}
+
+void DirectoryIndex::Directory::update(int slot, const DirectoryEntryRecord &record) {
+    unlink(slot);
+    mEntries[slot] = record;
+    mSlots.emplace(key(record), slot);
+}
+
+void DirectoryIndex::Directory::remove(int slot) {
+    int last = size() - 1;
+    unlink(slot);
+    if (slot != last) {
+        unlink(last);
+        mEntries[slot] = mEntries[last];
+        mSlots.emplace(key(mEntries[slot]), slot);
+    }
+    mEntries.pop_back();
+}
+
+std::shared_ptr<DirectoryIndex::Directory> DirectoryIndex::get(int cluster) {
+    auto it = mDirectories.find(cluster);
+    return it == mDirectories.end() ? nullptr : it->second;
+}
+
+/**
+ * @param clusters Directory cluster chain, the directory is keyed by its first cluster.
+ */
+std::shared_ptr<DirectoryIndex::Directory> DirectoryIndex::insert(std::vector<int> &&clusters,
+                                                                  std::vector<DirectoryEntryRecord> &&entries) {
+    if (mDirectories.size() >= MAX_INDEXED_DIRECTORIES) clear();
+    int cluster = clusters.front();
+    auto directory = std::make_shared<Directory>(std::move(clusters), std::move(entries));
+    mDirectories[cluster] = directory;
+    return directory;
+}
+
+void DirectoryIndex::invalidate(int cluster) {
+    mDirectories.erase(cluster);
+}
+
+void DirectoryIndex::clear() {
+    mDirectories.clear();
+}
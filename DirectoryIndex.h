@@ -0,0 +1,76 @@
+#ifndef ZOS_SP_DIRECTORYINDEX_H
+#define ZOS_SP_DIRECTORYINDEX_H
+
+#include "DirectoryEntry.h"
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Lazily built in-memory index of directories. Keeps the cluster chain and
+ * the allocated entries of a directory in slot order together with a hash
+ * of item names to slots, so name lookups, existence checks and removals
+ * don't scan the directory no matter how many clusters it spans. The index
+ * is write-through, FileSystem updates it along with every directory slot
+ * it writes. Directories are handed out as shared pointers, so one evicted
+ * while a concurrent reader still walks it stays alive until released.
+ */
+class DirectoryIndex {
+public:
+    class Directory {
+    private:
+        std::vector<int> mClusters;
+        std::vector<DirectoryEntryRecord> mEntries;
+        std::unordered_multimap<std::string, int> mSlots; // item name -> slot
+
+        static std::string key(const DirectoryEntryRecord &record);
+
+        void unlink(int slot);
+
+    public:
+        Directory(std::vector<int> &&clusters, std::vector<DirectoryEntryRecord> &&entries);
+
+        int size() const { return static_cast<int>(mEntries.size()); }
+
+        const std::vector<int> &clusters() const { return mClusters; }
+
+        void addCluster(int cluster) { mClusters.push_back(cluster); }
+
+        void removeLastCluster() { mClusters.pop_back(); }
+
+        const DirectoryEntryRecord &at(int slot) const { return mEntries[slot]; }
+
+        /**
+         * @return Lowest slot with given name (and type), -1 if there is none.
+         */
+        int find(const std::string &itemName, EFileOption option) const;
+
+        int findByCluster(int childCluster) const;
+
+        void append(const DirectoryEntryRecord &record);
+
+        void update(int slot, const DirectoryEntryRecord &record);
+
+        /**
+         * Moves last entry into the removed slot, same as on disk.
+         */
+        void remove(int slot);
+    };
+
+private:
+    static const size_t MAX_INDEXED_DIRECTORIES = 1 << 12;
+
+    std::unordered_map<int, std::shared_ptr<Directory>> mDirectories;
+
+public:
+    std::shared_ptr<Directory> get(int cluster);
+
+    std::shared_ptr<Directory> insert(std::vector<int> &&clusters, std::vector<DirectoryEntryRecord> &&entries);
+
+    void invalidate(int cluster);
+
+    void clear();
+};
+
+
+#endif //ZOS_SP_DIRECTORYINDEX_H
@@ -1,34 +1,56 @@
 #include "FAT.h"
 
 #include "definitions.h"
-#include "utils/stream-utils.h"
 
-void FAT::write(std::fstream &f, int32_t label) {
-    writeToStream(f, label);
+#include <algorithm>
+
+void FAT::load(IStorage &f, int64_t startAddress, int32_t clusterCount) {
+    mStartAddress = startAddress;
+    mTable.assign(clusterCount, FAT_UNUSED);
+    f.readAt(startAddress, reinterpret_cast<char *>(mTable.data()), mTable.size() * sizeof(int32_t));
+    mDirtyPages.assign((clusterCount + PAGE_ENTRIES - 1) / PAGE_ENTRIES, false);
+    mDirty = false;
 }
 
-void FAT::write(std::fstream &f, int32_t pos, int32_t label) {
-    f.seekp(pos);
-    FAT::write(f, label);
+void FAT::wipe(int64_t startAddress, int32_t clusterCount) {
+    mStartAddress = startAddress;
+    mTable.assign(clusterCount, FAT_UNUSED);
+    mDirtyPages.assign((clusterCount + PAGE_ENTRIES - 1) / PAGE_ENTRIES, true);
+    mDirty = true;
 }
 
-int FAT::read(std::fstream &f) {
-    int32_t clusterTag;
-    readFromStream(f, clusterTag);
-    return clusterTag;
+void FAT::markDirty(int32_t cluster) {
+    mDirtyPages[cluster / PAGE_ENTRIES] = true;
+    mDirty = true;
 }
 
-int FAT::read(std::fstream &f, int32_t pos) {
-    f.seekg(pos);
-    return FAT::read(f);
+void FAT::write(int32_t cluster, int32_t label) {
+    if (mTable[cluster] == label) return;
+    mTable[cluster] = label;
+    markDirty(cluster);
 }
 
-void FAT::wipe(std::ostream &f, int32_t startAddress, int32_t clusterCount) {
-    f.seekp(startAddress);
+/**
+ * Writes dirty pages back, neighbouring dirty pages are merged into one write.
+ */
+void FAT::flush(IStorage &f) {
+    if (!mDirty) return;
+
+    auto pageCount = static_cast<int32_t>(mDirtyPages.size());
+    auto tableSize = static_cast<int32_t>(mTable.size());
+    for (int32_t page = 0; page < pageCount; page++) {
+        if (!mDirtyPages[page]) continue;
+
+        int32_t lastPage = page;
+        while (lastPage + 1 < pageCount && mDirtyPages[lastPage + 1]) lastPage++;
 
-    auto labelUnused = reinterpret_cast<const char *>(&FAT_UNUSED);
-    for (int i = 0; i < clusterCount; i++) {
-        f.write(labelUnused, sizeof(FAT_UNUSED));
+        int32_t from = page * PAGE_ENTRIES;
+        int32_t to = std::min((lastPage + 1) * PAGE_ENTRIES, tableSize);
+        f.writeAt(mStartAddress + from * static_cast<int64_t>(sizeof(int32_t)),
+                  reinterpret_cast<const char *>(&mTable[from]), (to - from) * sizeof(int32_t));
+
+        for (int32_t i = page; i <= lastPage; i++) mDirtyPages[i] = false;
+        page = lastPage;
     }
+    mDirty = false;
 }
-
@@ -1,22 +1,43 @@
 #ifndef ZOS_SP_FAT_H
 #define ZOS_SP_FAT_H
 
-#include <fstream>
+#include "IStorage.h"
+#include <vector>
 
+/**
+ * In-memory copy of the FAT table. Labels are served from memory, changed
+ * labels are tracked per page and written back on flush().
+ */
 class FAT {
 private:
-    FAT(){}
+    static const int32_t PAGE_ENTRIES = 1024; // 4 KiB of labels
+
+    std::vector<int32_t> mTable;
+    std::vector<bool> mDirtyPages;
+    bool mDirty = false;
+    int64_t mStartAddress = 0;
+
+    void markDirty(int32_t cluster);
 
 public:
-    static void write(std::fstream &f, int32_t pos, int32_t label);
+    FAT() = default;
+
+    void load(IStorage &f, int64_t startAddress, int32_t clusterCount);
+
+    /**
+     * Labels every cluster as FAT_UNUSED, whole table is written on next flush.
+     */
+    void wipe(int64_t startAddress, int32_t clusterCount);
+
+    void flush(IStorage &f);
 
-    static void write(std::fstream &f, int32_t label);
+    int32_t read(int32_t cluster) const { return mTable[cluster]; }
 
-    static int read(std::fstream &f, int32_t pos);
+    void write(int32_t cluster, int32_t label);
 
-    static int read(std::fstream &f);
+    int32_t size() const { return static_cast<int32_t>(mTable.size()); }
 
-    static void wipe(std::ostream &f, int32_t startAddress, int32_t clusterCount);
+    bool isDirty() const { return mDirty; }
 };
 
 
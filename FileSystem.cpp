@@ -1,11 +1,20 @@
 #include "FileSystem.h"
 #include "FAT.h"
+#include "utils/file-copy.h"
+#include "utils/hash-utils.h"
+#include "utils/lz-codec.h"
 #include "utils/stream-utils.h"
 #include "utils/validators.h"
 
+#include <algorithm>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <map>
 #include <sstream>
 #include <cmath>
+#include <fcntl.h>
+#include <unistd.h>
 
 bool fileExists(const std::string &fileName) {
     std::ifstream stream(fileName);
@@ -16,8 +25,36 @@ bool isSpecialLabel(int label) {
     return label == FAT_UNUSED || label == FAT_FILE_END || label == FAT_BAD_CLUSTER;
 }
 
+static thread_local int commandLockDepth = 0;
 
-FileSystem::FileSystem(std::string &fileName) : mFileName(fileName) {
+FileSystem::CommandLock::CommandLock(FileSystem &fs, bool exclusive) :
+        mFS(fs), mExclusive(exclusive), mOwner(commandLockDepth == 0) {
+    if (mOwner) {
+        if (mExclusive) mFS.mCommandLock.lock();
+        else mFS.mCommandLock.lock_shared();
+    }
+    commandLockDepth++;
+}
+
+FileSystem::CommandLock::~CommandLock() {
+    commandLockDepth--;
+    if (!mOwner) return;
+    if (mExclusive) mFS.mCommandLock.unlock();
+    else mFS.mCommandLock.unlock_shared();
+}
+
+static thread_local Session *boundSession = nullptr;
+
+FileSystem::SessionScope::SessionScope(Session &session) : mPrevious(boundSession) {
+    boundSession = &session;
+}
+
+FileSystem::SessionScope::~SessionScope() {
+    boundSession = mPrevious;
+}
+
+FileSystem::FileSystem(std::string &fileName, EStorageType storageType, bool deduplicate) :
+        mFileName(fileName), mStorageType(storageType), mDeduplicate(deduplicate) {
     bool exists = fileExists(fileName);
 
     if (exists) {
@@ -32,15 +69,39 @@ FileSystem::FileSystem(std::string &fileName) : mFileName(fileName) {
     }
 }
 
-void FileSystem::readVFS() {
-    if (!mStream.is_open()) mStream.close();
-    auto mode = std::ios_base::in | std::ios_base::out | std::ios_base::binary | std::ios_base::ate;
-    mStream = std::fstream(mFileName, mode);
-    mStream.seekg(0, std::ios::beg);
+FileSystem::~FileSystem() {
+    commit();
+}
 
-    mBootSector.read(mStream);
+void FileSystem::readVFS() {
+    mJournal.reset();
+    mStorage.reset();
+    mStorage = openStorage(mStorageType, mFileName, false);
+    seek(0);
+
+    mBootSector.read(*mStorage);
+    openJournal();
+    mJournal->recover();
+    loadMetadata();
     seek(mBootSector.mDataStartAddress);
-    mWorkingDirectory.read(mStream);
+    DirectoryEntry rootDir;
+    rootDir.read(*mStorage, mBootSector.mVersion);
+    resetSessions(rootDir);
+}
+
+/**
+ * (Re)loads in-memory metadata from the image, pending journal blocks included.
+ */
+void FileSystem::loadMetadata() {
+    mPendingFreeClusters.clear();
+    mEndedFreeCount = 0;
+    mDentryCache.clear();
+    mDirectoryIndex.clear();
+    mReferenceCounts.clear();
+    mContentIndex.clear();
+    mFat.load(*mJournal, mBootSector.mFat1StartAddress, mBootSector.mClusterCount);
+    mFreeClusters.build(mFat);
+    mFreeExtents.build(mFreeClusters, mBootSector.mClusterCount);
 }
 
 std::ostream &operator<<(std::ostream &os, FileSystem const &fs) {
@@ -48,59 +109,65 @@ std::ostream &operator<<(std::ostream &os, FileSystem const &fs) {
               << "BOOT-SECTOR (" << BootSector::SIZE << "B)\n" << fs.mBootSector << "\n"
               << "FAT count: " << fs.mBootSector.mFatCount << "\n"
               << "FAT size: " << fs.mBootSector.getFatSize() << "\n\n"
-              << "PWD (root dir):\n" << fs.mWorkingDirectory << "\n"
+              << "PWD (root dir):\n" << fs.mRootDirectory << "\n"
               << "========== END OF FILE SYSTEM SPECS ========== \n";
 }
 
-void FileSystem::formatFS(int diskSize) {
-    if (!mStream.is_open()) mStream.close();
-    auto mode = std::ios_base::in | std::ios_base::out | std::ios_base::binary | std::ios_base::trunc;
-    mStream = std::fstream(mFileName, mode);
+void FileSystem::formatFS(int diskSize, int clusterSize) {
+    mJournal.reset();
+    mStorage.reset();
+    mStorage = openStorage(mStorageType, mFileName, true);
 
     // Write boot-sector
-    mBootSector = BootSector{diskSize};
-    mBootSector.write(mStream);
-
-    // Wipe each data cluster
-    seek(mBootSector.mDataStartAddress);
-    char wipedCluster[CLUSTER_SIZE] = {'\00'};
-    for (int i = 0; i < mBootSector.mClusterCount; i++) {
-        writeToStream(mStream, wipedCluster, CLUSTER_SIZE);
-    }
+    mBootSector = BootSector{diskSize, clusterSize};
+    mPendingFreeClusters.clear();
+    mEndedFreeCount = 0;
+    mDentryCache.clear();
+    mDirectoryIndex.clear();
+    mReferenceCounts.build({});
+    mContentIndex.clear();
+    mContentIndex.markBuilt();
+    // Image was truncated, resizing leaves it sparse and zeroed (data clusters wiped)
+    mStorage->resize(clusterToDataAddress(mBootSector.mClusterCount));
+    seek(0);
+    mBootSector.write(*mStorage);
 
     // Make root directory
     DirectoryEntry rootDir{std::string("."), false, 0, 0};
     DirectoryEntry rootDir2{std::string(".."), false, 0, 0}; // do i need it? todo
-    mWorkingDirectory = rootDir;
+    resetSessions(rootDir);
     seek(mBootSector.mDataStartAddress);
-    rootDir.write(mStream);
-    rootDir2.write(mStream);
+    rootDir.write(*mStorage);
+    rootDir2.write(*mStorage);
 
     // Wipe FAT tables
-    FAT::wipe(mStream, mBootSector.mFat1StartAddress, mBootSector.mClusterCount);
+    mFat.wipe(mBootSector.mFat1StartAddress, mBootSector.mClusterCount);
 
     // Label root directory cluster in FAT
-    FAT::write(mStream, mBootSector.mFat1StartAddress, FAT_FILE_END);
+    mFat.write(0, FAT_FILE_END);
+    mFreeClusters.build(mFat);
+    mFreeExtents.build(mFreeClusters, mBootSector.mClusterCount);
+
+    // Fresh image needs no journaling, journal region is zeroed by the resize
+    mFat.flush(*mStorage);
+    mStorage->sync();
+    openJournal();
 }
 
-bool FileSystem::findDirectoryEntry(int cluster, const std::string &itemName, DirectoryEntry &de) {
-    seek(clusterToDataAddress(cluster));
+/**
+ * Journals FAT pages and data clusters (directories).
+ */
+void FileSystem::openJournal() {
+    mJournal.reset(new Journal(*mStorage, mBootSector.mJournalStartAddress, mBootSector.mJournalSize));
+    mJournal->addRegion(mBootSector.mFat1StartAddress, mBootSector.mFat1StartAddress + mBootSector.getFatSize(),
+                        JOURNAL_BLOCK_SIZE);
+    // block size divides the cluster size (both powers of two), blocks don't cross clusters
+    mJournal->addRegion(mBootSector.mDataStartAddress, clusterToDataAddress(mBootSector.mClusterCount),
+                        std::min(mBootSector.mClusterSize, JOURNAL_BLOCK_SIZE));
+}
 
-    DirectoryEntry tempDE{};
-    auto itemNameCharArr = itemName.c_str();
-    for (int i = 0; i < MAX_ENTRIES; i++) {
-        tempDE.read(mStream);
-        if (tempDE.mItemName.empty()) {
-            if (i < DEFAULT_DIR_SIZE)
-                throw std::runtime_error(DE_MISSING_REFERENCES_ERROR);
-            return false;
-        }
-        if (!strcmp(tempDE.mItemName.c_str(), itemNameCharArr)) { // ignore \00 (NULL) paddings
-            de = tempDE;
-            return true;
-        }
-    }
-    return false;
+bool FileSystem::findDirectoryEntry(int cluster, const std::string &itemName, DirectoryEntry &de) {
+    return findDirectoryEntry(cluster, itemName, de, EFileOption::UNSPECIFIED);
 }
 
 /**
@@ -108,43 +175,42 @@ bool FileSystem::findDirectoryEntry(int cluster, const std::string &itemName, Di
  * copies the found data into passed object.
  */
 bool FileSystem::findDirectoryEntry(int cluster, const std::string &itemName, DirectoryEntry &de, bool isFile) {
-    seek(clusterToDataAddress(cluster));
+    return findDirectoryEntry(cluster, itemName, de, isFile ? EFileOption::FILE : EFileOption::DIRECTORY);
+}
 
-    DirectoryEntry tempDE{};
-    auto itemNameCharArr = itemName.c_str();
-    for (int i = 0; i < MAX_ENTRIES; i++) {
-        tempDE.read(mStream);
-        if (tempDE.mItemName.empty()) {
-            if (i < DEFAULT_DIR_SIZE)
-                throw std::runtime_error(DE_MISSING_REFERENCES_ERROR);
-            return false;
-        }
-        if (!strcmp(tempDE.mItemName.c_str(), itemNameCharArr) &&
-            tempDE.mIsFile == isFile) { // ignore \00 (NULL) paddings
-            de = tempDE;
-            return true;
-        }
+bool FileSystem::findDirectoryEntry(int cluster, const std::string &itemName, DirectoryEntry &de, EFileOption option) {
+    {
+        std::lock_guard<std::mutex> lock(mCacheMutex);
+        auto cached = mDentryCache.lookup(cluster, itemName, option, de);
+        if (cached != ELookupResult::MISS) return cached == ELookupResult::FOUND;
     }
-    return false;
+
+    auto directory = getIndexedDirectory(cluster);
+    int slot = directory->find(itemName, option);
+    std::lock_guard<std::mutex> lock(mCacheMutex);
+    if (slot < 0) {
+        mDentryCache.insert(cluster, itemName, option, nullptr);
+        return false;
+    }
+    de = DirectoryEntry(directory->at(slot));
+    mDentryCache.insert(cluster, itemName, option, &de);
+    return true;
 }
 
 bool FileSystem::findDirectoryEntry(int parentCluster, int childCluster, DirectoryEntry &de) {
-    seek(clusterToDataAddress(parentCluster));
-
-    DirectoryEntry tempDE{};
-    for (int i = 0; i < MAX_ENTRIES; i++) {
-        tempDE.read(mStream);
-        if (!isAllocatedDirectoryEntry(tempDE.mItemName)) {
-            if (i < DEFAULT_DIR_SIZE)
-                throw std::runtime_error(DE_MISSING_REFERENCES_ERROR);
-            return false;
-        }
-        if (tempDE.mStartCluster == childCluster) {
-            de = tempDE;
-            return true;
-        }
+    {
+        std::lock_guard<std::mutex> lock(mCacheMutex);
+        if (mDentryCache.lookup(parentCluster, childCluster, de) == ELookupResult::FOUND) return true;
     }
-    return false;
+
+    auto directory = getIndexedDirectory(parentCluster);
+    int slot = directory->findByCluster(childCluster);
+    if (slot < 0) return false;
+
+    de = DirectoryEntry(directory->at(slot));
+    std::lock_guard<std::mutex> lock(mCacheMutex);
+    mDentryCache.insert(parentCluster, childCluster, de);
+    return true;
 }
 
 /**
@@ -154,23 +220,63 @@ bool FileSystem::findDirectoryEntry(int parentCluster, int childCluster, Directo
  * @return True on success, false otherwise.
  */
 bool FileSystem::getDirectory(int cluster, DirectoryEntry &de) {
-    DirectoryEntry toFindDE{}, parentDE{};
-
-    seek(clusterToDataAddress(cluster));
+    auto directory = getIndexedDirectory(cluster);
 
-    toFindDE.read(mStream);
-    if (!isAllocatedDirectoryEntry(toFindDE.mItemName)) return false;
-
-    parentDE.read(mStream);
-    if (!isAllocatedDirectoryEntry(parentDE.mItemName)) return false;
-
-    if (findDirectoryEntry(parentDE.mStartCluster, toFindDE.mStartCluster, toFindDE)) {
+    DirectoryEntry toFindDE{directory->at(0)};
+    if (findDirectoryEntry(directory->at(1).mStartCluster, toFindDE.mStartCluster, toFindDE)) {
         de = toFindDE;
         return true;
     }
     return false;
 }
 
+DirectoryEntry FileSystem::makeDirectory(DirectoryEntry parentDE, const std::string &name) {
+    int32_t newFreeCluster = getFreeClusters().back();
+
+    // Update parent directory with the new directory entry
+    DirectoryEntry newDE{name, false, 0, newFreeCluster};
+    writeNewDirectoryEntry(parentDE.mStartCluster, newDE);
+    DirectoryEntry createdDE = newDE;
+
+    // Write references ".' and ".."
+    writeDirectoryEntryReferences(parentDE, newDE, newFreeCluster);
+
+    // All went ok, label new cluster as allocated
+    writeToFatByCluster(newFreeCluster, FAT_FILE_END);
+    return createdDE;
+}
+
+std::vector<int> FileSystem::getDirectoryTree(int cluster) {
+    std::vector<int> directories{cluster};
+    for (size_t i = 0; i < directories.size(); i++) {
+        auto directory = getIndexedDirectory(directories[i]);
+        for (int slot = DEFAULT_DIR_SIZE; slot < directory->size(); slot++) {
+            if (!directory->at(slot).isFile()) directories.push_back(directory->at(slot).mStartCluster);
+        }
+    }
+    return directories;
+}
+
+/**
+ * Frees files and clusters of directories already unlinked from the tree,
+ * all FAT label changes are applied in one batch.
+ */
+void FileSystem::releaseDirectoryTree(const std::vector<int> &directories) {
+    std::vector<int> freedClusters{};
+    for (auto &it: directories) {
+        auto directory = getIndexedDirectory(it);
+        for (int slot = DEFAULT_DIR_SIZE; slot < directory->size(); slot++) {
+            if (!directory->at(slot).isFile()) continue;
+            DirectoryEntry de{directory->at(slot)};
+            releaseFileChain(de, freedClusters);
+        }
+        freedClusters.insert(freedClusters.end(), directory->clusters().begin(), directory->clusters().end());
+        mDentryCache.invalidate(it);
+        mDirectoryIndex.invalidate(it);
+    }
+    labelFatClusterChain(freedClusters, FAT_UNUSED);
+}
+
 /**
  * Force delete, i.e. doesn't check if directory is empty.
  */
@@ -179,89 +285,335 @@ bool FileSystem::removeDirectoryEntry(int parentCluster, const std::string &item
 
     if (!isFile && (!strcmp(itemNameCharArr, ".") || !strcmp(itemNameCharArr, ".."))) return false;
 
-    auto startAddress = clusterToDataAddress(parentCluster);
-    seek(startAddress);
-    int32_t removeAddress;
-
-    DirectoryEntry tempDE{}, lastDE{};
-    char emptyBfr[DirectoryEntry::SIZE] = {'\00'};
-    bool erased = false;
-    for (int i = 0; i < MAX_ENTRIES; i++) {
-        tempDE.read(mStream);
-        if (!isAllocatedDirectoryEntry(tempDE.mItemName)) { // we are at the end
-            if (i < DEFAULT_DIR_SIZE)
-                throw std::runtime_error(DE_MISSING_REFERENCES_ERROR);
-            if (!erased) return false; // we are at the end, and we didn't find entry to remove
-            seek(removeAddress);
-            lastDE.write(mStream); // write last entry instead of erased entry
-            auto lastAddress = startAddress + (i - 1) * DirectoryEntry::SIZE;
-            seek(lastAddress);
-            mStream.write(emptyBfr, DirectoryEntry::SIZE); // erase last entry
-            return true;
-        }
-        lastDE = tempDE;
-        if (!erased && !strcmp(tempDE.mItemName.c_str(), itemNameCharArr) && tempDE.mIsFile == isFile) {
-            // remove entry from data cluster
-            removeAddress = startAddress + i * DirectoryEntry::SIZE;
-            seek(removeAddress);
-            mStream.write(emptyBfr, DirectoryEntry::SIZE); // erase entry to be removed
-            erased = true;
-            flush();
+    auto directory = getIndexedDirectory(parentCluster);
+    int slot = directory->find(itemName, isFile ? EFileOption::FILE : EFileOption::DIRECTORY);
+    if (slot < 0) return false;
+
+    // keep entries packed, move last entry instead of the removed one
+    int last = directory->size() - 1;
+    mDentryCache.invalidate(parentCluster);
+    if (slot != last) writeDirectoryEntryAt(*directory, slot, directory->at(last));
+    writeDirectoryEntryAt(*directory, last, DirectoryEntryRecord{});
+    directory->remove(slot);
+    shrinkDirectory(*directory);
+    flush();
+    return true;
+}
+
+/**
+ * Reads whole directory cluster in one I/O, entries of older versions are
+ * converted to current records.
+ * @return Number of allocated entries, which are always packed at the start.
+ */
+int FileSystem::readDirectory(int cluster, std::vector<int> &clusters, std::vector<DirectoryEntryRecord> &entries) {
+    clusters = getFatClusterChain(cluster);
+    entries.clear();
+
+    int entryCount = getClusterEntryCount();
+    int entrySize = DirectoryEntry::getRecordSize(mBootSector.mVersion);
+    std::vector<char> legacyCluster(entrySize == DirectoryEntry::SIZE ? 0 : entryCount * entrySize);
+    int count = 0;
+    for (auto &it: clusters) {
+        entries.resize(count + entryCount);
+        if (legacyCluster.empty()) {
+            mJournal->readAt(clusterToDataAddress(it), reinterpret_cast<char *>(&entries[count]),
+                             entryCount * DirectoryEntry::SIZE);
+        } else {
+            mJournal->readAt(clusterToDataAddress(it), legacyCluster.data(), legacyCluster.size());
+            for (int i = 0; i < entryCount; i++)
+                entries[count + i] = DirectoryEntry::loadRecord(&legacyCluster[i * entrySize], mBootSector.mVersion);
         }
+
+        int end = count + entryCount;
+        while (count < end && entries[count].isAllocated()) count++;
+        if (count < end) break;
     }
-    return false;
+
+    if (count < DEFAULT_DIR_SIZE)
+        throw std::runtime_error(DE_MISSING_REFERENCES_ERROR);
+    entries.resize(count);
+    return count;
+}
+
+/**
+ * Returns index of directory cluster, reading the cluster on first access.
+ * Concurrent readers missing the same directory both read it, the later
+ * insert wins.
+ */
+std::shared_ptr<DirectoryIndex::Directory> FileSystem::getIndexedDirectory(int cluster) {
+    {
+        std::lock_guard<std::mutex> lock(mCacheMutex);
+        auto directory = mDirectoryIndex.get(cluster);
+        if (directory) return directory;
+    }
+
+    std::vector<int> clusters;
+    std::vector<DirectoryEntryRecord> entries;
+    readDirectory(cluster, clusters, entries);
+    std::lock_guard<std::mutex> lock(mCacheMutex);
+    return mDirectoryIndex.insert(std::move(clusters), std::move(entries));
+}
+
+void FileSystem::writeDirectoryEntryAt(const DirectoryIndex::Directory &directory, int slot,
+                                       const DirectoryEntryRecord &record) {
+    int entrySize = DirectoryEntry::getRecordSize(mBootSector.mVersion);
+    auto cluster = directory.clusters().at(slot / getClusterEntryCount());
+    auto address = clusterToDataAddress(cluster) + (slot % getClusterEntryCount()) * entrySize;
+    char data[DirectoryEntry::SIZE];
+    DirectoryEntry::storeRecord(record, data, mBootSector.mVersion);
+    mJournal->writeAt(address, data, entrySize);
+}
+
+/**
+ * Appends new zeroed cluster to the directory chain, preferably the one
+ * right after its current last cluster.
+ */
+void FileSystem::growDirectory(DirectoryIndex::Directory &directory) {
+    int lastCluster = directory.clusters().back();
+    int newCluster = lastCluster + 1;
+    if (newCluster >= mBootSector.mClusterCount || !mFreeClusters.isFree(newCluster))
+        newCluster = getFreeClusters().back();
+
+    std::vector<char> emptyCluster(mBootSector.mClusterSize, '\00');
+    mJournal->writeAt(clusterToDataAddress(newCluster), emptyCluster.data(), emptyCluster.size());
+
+    writeToFatByCluster(newCluster, FAT_FILE_END);
+    writeToFatByCluster(lastCluster, newCluster);
+    directory.addCluster(newCluster);
+}
+
+/**
+ * Releases last cluster of the directory chain once no entry lives in it.
+ */
+void FileSystem::shrinkDirectory(DirectoryIndex::Directory &directory) {
+    auto &clusters = directory.clusters();
+    if (clusters.size() < 2
+        || static_cast<size_t>(directory.size()) > (clusters.size() - 1) * getClusterEntryCount())
+        return;
+
+    writeToFatByCluster(clusters[clusters.size() - 2], FAT_FILE_END);
+    writeToFatByCluster(clusters.back(), FAT_UNUSED);
+    directory.removeLastCluster();
 }
 
 int FileSystem::getDirectoryEntryCount(int cluster) {
-    seek(clusterToDataAddress(cluster));
-
-    int i;
-    DirectoryEntry tempDE{};
-    for (i = 0; i < MAX_ENTRIES; i++) {
-        tempDE.read(mStream);
-        if (!isAllocatedDirectoryEntry(tempDE.mItemName)) {
-            if (i < DEFAULT_DIR_SIZE)
-                throw std::runtime_error(DE_MISSING_REFERENCES_ERROR);
-            break;
-        }
+    return getIndexedDirectory(cluster)->size();
+}
+
+std::vector<ClusterRun> FileSystem::getClusterRuns(const std::vector<int> &clusters) {
+    std::vector<ClusterRun> runs{};
+    for (size_t i = 0; i < clusters.size();) {
+        auto length = getRunLength(clusters, i, clusters.size());
+        runs.push_back({clusters[i], static_cast<int>(length)});
+        i += length;
     }
-    return i;
+    return runs;
+}
+
+int FileSystem::getNeededClustersCount(int64_t fileSize) const {
+    return static_cast<int>((fileSize + mBootSector.mClusterSize - 1) / mBootSector.mClusterSize);
+}
+
+int64_t FileSystem::getMaxFileSize() const {
+    return mBootSector.mVersion >= 3 ? INT64_MAX : INT32_MAX;
 }
 
-int FileSystem::getNeededClustersCount(int fileSize) const {
-    return std::ceil(fileSize / static_cast<double>(mBootSector.mClusterSize));
+int64_t FileSystem::clusterToDataAddress(int cluster) const {
+    return mBootSector.mDataStartAddress + static_cast<int64_t>(cluster) * mBootSector.mClusterSize;
 }
 
-int FileSystem::clusterToDataAddress(int cluster) const {
-    return mBootSector.mDataStartAddress + cluster * mBootSector.mClusterSize;
+int64_t FileSystem::clusterToFatAddress(int cluster) const {
+    return mBootSector.mFat1StartAddress + cluster * static_cast<int64_t>(sizeof(int32_t));
 }
 
-int FileSystem::clusterToFatAddress(int cluster) const {
-    return mBootSector.mFat1StartAddress + cluster * static_cast<int32_t>(sizeof(int32_t));
+int FileSystem::getClusterEntryCount() const {
+    return mBootSector.mClusterSize / DirectoryEntry::getRecordSize(mBootSector.mVersion);
 }
 
-void FileSystem::seek(int pos) {
-    mStream.seekp(pos);
+void FileSystem::seek(int64_t pos) {
+    mStorage->seek(pos);
 }
 
 void FileSystem::flush() {
-    mStream.flush();
+    if (!mStorage) return;
+    mFat.flush(*mJournal);
+    mStorage->flush();
+}
+
+/**
+ * Ends metadata transaction of a command, it's committed right away unless
+ * commits are grouped.
+ */
+void FileSystem::endTransaction() {
+    if (!mStorage || mBatch) return;
+    flush();
+    mJournal->endTransaction();
+    mEndedFreeCount = mPendingFreeClusters.size();
+    if (!mGroupCommitDepth || mJournal->pendingTransactions() >= GROUP_COMMIT_TRANSACTIONS || mJournal->isFull())
+        commit();
+}
+
+/**
+ * Drops metadata changes of a failed command, transactions waiting for
+ * group commit are kept. A batch is rolled back as a whole instead and
+ * images without journal keep what was already written.
+ */
+void FileSystem::abortTransaction() {
+    if (!mStorage || mBatch || !mJournal->isBuffering()) return;
+    if (!mJournal->abortTransaction() && !mFat.isDirty()) return;
+
+    // clusters freed by earlier transactions stay reserved until commit
+    mPendingFreeClusters.resize(mEndedFreeCount);
+    auto pendingFreeClusters = std::move(mPendingFreeClusters);
+    loadMetadata();
+    for (auto &it: pendingFreeClusters) {
+        if (mFat.read(it) != FAT_UNUSED || !mFreeClusters.isFree(it)) continue;
+        mFreeClusters.markUsed(it);
+        mFreeExtents.markUsed(it);
+        mPendingFreeClusters.push_back(it);
+    }
+    mEndedFreeCount = mPendingFreeClusters.size();
+}
+
+/**
+ * Writes pending transactions to the image, batch is written only by endBatch.
+ */
+void FileSystem::commit() {
+    if (!mStorage || mBatch) return;
+    flush();
+    mJournal->commit();
+    releasePendingFreeClusters(mPendingFreeClusters.size());
+}
+
+/**
+ * Commits transactions ended before the running one, so clusters they freed
+ * can be reused. Changes of the running transaction stay pending.
+ */
+void FileSystem::commitEndedTransactions() {
+    if (!mStorage || mBatch) return;
+    flush();
+    mJournal->commitEnded();
+    releasePendingFreeClusters(mEndedFreeCount);
+}
+
+/**
+ * Freed clusters can be reused once the transaction freeing them is durable.
+ * @param count Leading pending clusters freed by committed transactions.
+ */
+void FileSystem::releasePendingFreeClusters(size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        int cluster = mPendingFreeClusters[i];
+        if (mFat.read(cluster) != FAT_UNUSED) continue;
+        mFreeClusters.markFree(cluster);
+        mFreeExtents.markFree(cluster);
+    }
+    mPendingFreeClusters.erase(mPendingFreeClusters.begin(), mPendingFreeClusters.begin() + count);
+    mEndedFreeCount = 0;
+}
+
+/**
+ * Groups commits of following transactions (e.g. commands of a script),
+ * calls can be nested.
+ */
+void FileSystem::beginGroupCommit() {
+    mGroupCommitDepth++;
+}
+
+void FileSystem::endGroupCommit() {
+    if (--mGroupCommitDepth == 0) commit();
+}
+
+/**
+ * Keeps all following metadata changes in memory (even beyond the journal
+ * capacity) until endBatch() applies them at once, or rollbackBatch()
+ * drops them.
+ */
+void FileSystem::beginBatch() {
+    commit();
+    mJournal->setBatch(true);
+    mBatch = true;
+    mBatchWorkingDirectory = getSession().mWorkingDirectory;
+}
+
+void FileSystem::endBatch() {
+    mBatch = false;
+    commit();
+    mJournal->setBatch(false);
+}
+
+/**
+ * Restores the state before beginBatch(). Clusters freed in the batch were
+ * never reused, so file data of the restored entries are intact.
+ */
+void FileSystem::rollbackBatch() {
+    mBatch = false;
+    mJournal->discard();
+    mJournal->setBatch(false);
+    loadMetadata();
+    setWorkingDirectory(mBatchWorkingDirectory);
+}
+
+Session &FileSystem::getSession() {
+    return boundSession ? *boundSession : mConsoleSession;
+}
+
+void FileSystem::openSession(Session &session) {
+    std::lock_guard<std::mutex> lock(mSessionMutex);
+    session.mWorkingDirectory = mRootDirectory;
+    session.mWorkingDirectoryPath = "/";
+    mSessions.insert(&session);
+}
+
+void FileSystem::closeSession(Session &session) {
+    std::lock_guard<std::mutex> lock(mSessionMutex);
+    mSessions.erase(&session);
+}
+
+void FileSystem::resetSessions(const DirectoryEntry &rootDirectory) {
+    std::lock_guard<std::mutex> lock(mSessionMutex);
+    mRootDirectory = rootDirectory;
+    mConsoleSession.mWorkingDirectory = rootDirectory;
+    mConsoleSession.mWorkingDirectoryPath = "/";
+    for (auto &it: mSessions) {
+        it->mWorkingDirectory = rootDirectory;
+        it->mWorkingDirectoryPath = "/";
+    }
+}
+
+bool FileSystem::isWorkingDirectoryOfOtherSession(int cluster) {
+    auto &current = getSession();
+    std::lock_guard<std::mutex> lock(mSessionMutex);
+    if (&current != &mConsoleSession && mConsoleSession.mWorkingDirectory.mStartCluster == cluster) return true;
+    for (auto &it: mSessions) {
+        if (it != &current && it->mWorkingDirectory.mStartCluster == cluster) return true;
+    }
+    return false;
+}
+
+const DirectoryEntry &FileSystem::getWorkingDirectory() {
+    return getSession().mWorkingDirectory;
+}
+
+void FileSystem::setWorkingDirectory(const DirectoryEntry &de) {
+    getSession().mWorkingDirectory = de;
+    updateWorkingDirectoryPath();
 }
 
 void FileSystem::updateWorkingDirectoryPath() {
-    if (mWorkingDirectory.mStartCluster == 0) {
-        mWorkingDirectoryPath = "/";
+    auto &session = getSession();
+    if (session.mWorkingDirectory.mStartCluster == 0) {
+        session.mWorkingDirectoryPath = "/";
         return;
     }
     std::queue<std::string> fileNames{};
 
-    DirectoryEntry de = mWorkingDirectory;
+    DirectoryEntry de = session.mWorkingDirectory;
 
     int childCluster = de.mStartCluster, parentCluster;
     int safetyCounter = 0;
     while (true) {
         safetyCounter++;
-        if (safetyCounter > MAX_ENTRIES)
+        if (safetyCounter > mBootSector.mClusterCount)
             throw std::runtime_error(CORRUPTED_FS_ERROR);
 
         if (childCluster == 0) break;
@@ -284,98 +636,149 @@ void FileSystem::updateWorkingDirectoryPath() {
         stream << "/" << fileNames.front().c_str();
         fileNames.pop();
     }
-    mWorkingDirectoryPath = stream.str();
+    session.mWorkingDirectoryPath = stream.str();
 }
 
 std::string FileSystem::getWorkingDirectoryPath() {
-    return mWorkingDirectoryPath;
+    return getSession().mWorkingDirectoryPath;
 }
 
 bool FileSystem::editDirectoryEntry(int parentCluster, int childCluster, DirectoryEntry &de) {
-    auto startAddress = clusterToDataAddress(parentCluster);
-    seek(startAddress);
-
-    DirectoryEntry tempDE{};
-    for (int i = 0; i < MAX_ENTRIES; i++) {
-        tempDE.read(mStream);
-        if (!isAllocatedDirectoryEntry(tempDE.mItemName)) {
-            if (i < DEFAULT_DIR_SIZE)
-                throw std::runtime_error(DE_MISSING_REFERENCES_ERROR);
-            return false;
-        }
-        if (tempDE.mStartCluster == childCluster) {
-            auto lastAddress = startAddress + i * DirectoryEntry::SIZE;
-            seek(lastAddress);
-            de.write(mStream);
-            return true;
-        }
-    }
-    return false;
+    auto directory = getIndexedDirectory(parentCluster);
+    int slot = directory->findByCluster(childCluster);
+    if (slot < 0) return false;
+
+    auto record = de.toRecord();
+    mDentryCache.invalidate(parentCluster);
+    writeDirectoryEntryAt(*directory, slot, record);
+    directory->update(slot, record);
+    return true;
 }
 
+/**
+ * Prefers a single contiguous run (best fit). Unless `ordered` is requested,
+ * falls back to collecting clusters from the longest free runs. Clusters
+ * freed by earlier commands of a script are made reusable by committing
+ * their transactions when there isn't enough space otherwise, clusters
+ * freed by the running command never are.
+ */
 std::vector<int> FileSystem::getFreeClusters(int count, bool ordered) {
     if (count > mBootSector.mClusterCount)
         throw std::runtime_error("not enough space, format file system");
 
-    seek(mBootSector.mFat1StartAddress);
+    auto clusters = findFreeClusters(count, ordered);
+    if (clusters.size() != static_cast<size_t>(count) && mEndedFreeCount && !mBatch) {
+        commitEndedTransactions();
+        clusters = findFreeClusters(count, ordered);
+    }
+
+    if (clusters.size() != static_cast<size_t>(count))
+        throw std::runtime_error("not enough space, format file system or free some space");
 
-    int32_t label;
+    return clusters;
+}
+
+/**
+ * @return Free clusters, empty if there is not enough of them.
+ */
+std::vector<int> FileSystem::findFreeClusters(int count, bool ordered) const {
     std::vector<int> clusters{};
-    clusters.reserve(count);
-    for (int32_t i = 0; i < mBootSector.mClusterCount && clusters.size() < count; i++) {
-        readFromStream(mStream, label);
-        if (label == FAT_UNUSED) {
-            if (ordered && !clusters.empty()) {
-                if (clusters.back() + 1 != i) {
-                    clusters.clear();
-                    continue;
-                }
+    if (count <= mFreeClusters.freeCount()) {
+        int32_t start = mFreeExtents.bestFit(count);
+        if (start >= 0) {
+            clusters.reserve(count);
+            for (int32_t i = 0; i < count; i++) {
+                clusters.push_back(start + i);
             }
-            clusters.push_back(i);
+        } else if (!ordered) {
+            clusters = mFreeExtents.largestFirst(count);
         }
     }
+    return clusters;
+}
 
-    if (clusters.size() != count)
-        throw std::runtime_error("not enough space, format file system or free some space");
+bool FileSystem::editDirectoryEntry(int parentCluster, const std::string &itemName, DirectoryEntry &de) {
+    auto directory = getIndexedDirectory(parentCluster);
+    int slot = directory->find(itemName, de.mIsFile ? EFileOption::FILE : EFileOption::DIRECTORY);
+    if (slot < 0) return false;
 
-    return clusters;
+    auto record = de.toRecord();
+    mDentryCache.invalidate(parentCluster);
+    writeDirectoryEntryAt(*directory, slot, record);
+    directory->update(slot, record);
+    return true;
 }
 
 void FileSystem::seekStreamToDataCluster(int cluster) {
-    int32_t address = clusterToDataAddress(cluster);
+    int64_t address = clusterToDataAddress(cluster);
     seek(address);
 }
 
-int FileSystem::getDirectoryNextFreeEntryAddress(int cluster) {
-    auto address = clusterToDataAddress(cluster);
-    seek(address);
+void FileSystem::writeNewDirectoryEntry(int directoryCluster, DirectoryEntry &newDE) {
+    auto directory = getIndexedDirectory(directoryCluster);
+    if (static_cast<size_t>(directory->size()) == directory->clusters().size() * getClusterEntryCount())
+        growDirectory(*directory);
+
+    mDentryCache.invalidate(directoryCluster);
+    auto record = newDE.toRecord();
+    writeDirectoryEntryAt(*directory, directory->size(), record);
+    directory->append(record);
+}
 
-    DirectoryEntry temp{};
-    for (int entriesCount = 0; entriesCount < MAX_ENTRIES; entriesCount++) {
-        temp.read(mStream);
-        if (!isAllocatedDirectoryEntry(temp.mItemName)) {
-            if (entriesCount < DEFAULT_DIR_SIZE)
-                throw std::runtime_error(DE_MISSING_REFERENCES_ERROR);
-            return address + entriesCount * DirectoryEntry::SIZE;
+void FileSystem::writeToFatByCluster(int cluster, int label) {
+    mFat.write(cluster, label);
+    bool wasFree = mFreeClusters.isFree(cluster);
+    if (label == FAT_UNUSED && !wasFree) {
+        if (mJournal->isBuffering()) {
+            mPendingFreeClusters.push_back(cluster);
+        } else {
+            mFreeClusters.markFree(cluster);
+            mFreeExtents.markFree(cluster);
         }
+    } else if (label != FAT_UNUSED && wasFree) {
+        mFreeClusters.markUsed(cluster);
+        mFreeExtents.markUsed(cluster);
     }
-    throw std::runtime_error(DE_LIMIT_REACHED_ERROR);
 }
 
-void FileSystem::writeNewDirectoryEntry(int directoryCluster, DirectoryEntry &newDE) {
-    int32_t freeParentEntryAddr = getDirectoryNextFreeEntryAddress(directoryCluster);
-    seek(freeParentEntryAddr);
-    newDE.write(mStream);
-}
+/**
+ * Applies label changes sorted by cluster, so FAT pages are touched in order
+ * and free space is updated once per run of consecutive clusters rather than
+ * cluster by cluster. Every cluster may be labeled only once.
+ */
+void FileSystem::writeFatLabels(std::vector<FatLabel> &labels) {
+    std::sort(labels.begin(), labels.end(), [](const FatLabel &a, const FatLabel &b) {
+        return a.mCluster < b.mCluster;
+    });
+
+    std::vector<int> freed{}, used{};
+    for (auto &it: labels) {
+        mFat.write(it.mCluster, it.mLabel);
+        bool wasFree = mFreeClusters.isFree(it.mCluster);
+        if (it.mLabel == FAT_UNUSED && !wasFree) freed.push_back(it.mCluster);
+        else if (it.mLabel != FAT_UNUSED && wasFree) used.push_back(it.mCluster);
+    }
 
-void FileSystem::writeToFatByCluster(int cluster, int label) {
-    int address = clusterToFatAddress(cluster);
-    FAT::write(mStream, address, label);
+    if (mJournal->isBuffering()) {
+        mPendingFreeClusters.insert(mPendingFreeClusters.end(), freed.begin(), freed.end());
+    } else {
+        for (auto &run: getClusterRuns(freed)) {
+            for (int i = 0; i < run.mLength; i++) {
+                mFreeClusters.markFree(run.mStartCluster + i);
+            }
+            mFreeExtents.markFree(run.mStartCluster, run.mLength);
+        }
+    }
+    for (auto &run: getClusterRuns(used)) {
+        for (int i = 0; i < run.mLength; i++) {
+            mFreeClusters.markUsed(run.mStartCluster + i);
+        }
+        mFreeExtents.markUsed(run.mStartCluster, run.mLength);
+    }
 }
 
 int FileSystem::readFromFatByCluster(int cluster) {
-    int address = clusterToFatAddress(cluster);
-    return FAT::read(mStream, address);
+    return mFat.read(cluster);
 }
 
 /**
@@ -383,35 +786,26 @@ int FileSystem::readFromFatByCluster(int cluster) {
  * @param newDE modifies item name to "."
  */
 void FileSystem::writeDirectoryEntryReferences(DirectoryEntry &parentDE, DirectoryEntry &newDE, int newFreeCluster) {
-    // Erase previous cluster data
-    seekStreamToDataCluster(newFreeCluster);
-    auto clusterSize = mBootSector.mClusterSize;
-    char emptyCluster[CLUSTER_SIZE] = {'\00'};
-    mStream.write(emptyCluster, clusterSize);
-
-    // Create new directory "." at new cluster
-    seekStreamToDataCluster(newFreeCluster);
     newDE.mItemName = ".";
-    newDE.write(mStream);
-
-    // Create new directory ".." at new cluster
     parentDE.mItemName = "..";
-    parentDE.write(mStream);
-
-
+    mDentryCache.invalidate(newFreeCluster);
+    mDirectoryIndex.invalidate(newFreeCluster);
+
+    // Erase previous cluster data and create "." and ".." references in one write
+    std::vector<char> cluster(mBootSector.mClusterSize, '\00');
+    DirectoryEntry::storeRecord(newDE.toRecord(), cluster.data(), mBootSector.mVersion);
+    DirectoryEntry::storeRecord(parentDE.toRecord(), cluster.data() + DirectoryEntry::getRecordSize(mBootSector.mVersion),
+                                mBootSector.mVersion);
+    mJournal->writeAt(clusterToDataAddress(newFreeCluster), cluster.data(), cluster.size());
 }
 
 std::vector<std::string> FileSystem::getDirectoryContents(int directoryCluster) {
-    std::vector<std::string> fileNames{};
-    DirectoryEntry de{};
-    seekStreamToDataCluster(directoryCluster);
-    for (int i = 0; i < MAX_ENTRIES; i++) {
-        de.read(mStream);
-        if (!isAllocatedDirectoryEntry(de.mItemName)) {
-            if (i < DEFAULT_DIR_SIZE)
-                throw std::runtime_error(DE_MISSING_REFERENCES_ERROR);
-        }
-        fileNames.push_back(de.mItemName);
+    auto directory = getIndexedDirectory(directoryCluster);
+
+    // free slots of allocated clusters are listed as empty names
+    std::vector<std::string> fileNames(directory->clusters().size() * getClusterEntryCount());
+    for (int i = 0; i < directory->size(); i++) {
+        fileNames[i] = std::string(directory->at(i).mItemName, ITEM_NAME_LENGTH);
     }
     return fileNames;
 }
@@ -422,16 +816,22 @@ bool FileSystem::directoryEntryExists(int cluster, const std::string &itemName,
 }
 
 void FileSystem::makeFatChain(std::vector<int> &clusters) {
-    for (int i = 0; i < clusters.size() - 1; i++) {
-        writeToFatByCluster(clusters.at(i), clusters.at(i + 1));
+    std::vector<FatLabel> labels{};
+    labels.reserve(clusters.size());
+    for (size_t i = 0; i + 1 < clusters.size(); i++) {
+        labels.push_back({clusters[i], clusters[i + 1]});
     }
-    writeToFatByCluster(clusters.back(), FAT_FILE_END);
+    labels.push_back({clusters.back(), FAT_FILE_END});
+    writeFatLabels(labels);
 }
 
 void FileSystem::labelFatClusterChain(std::vector<int> &clusters, int32_t label) {
+    std::vector<FatLabel> labels{};
+    labels.reserve(clusters.size());
     for (auto &it: clusters) {
-        writeToFatByCluster(it, label);
+        labels.push_back({it, label});
     }
+    writeFatLabels(labels);
 }
 
 /**
@@ -440,8 +840,8 @@ void FileSystem::labelFatClusterChain(std::vector<int> &clusters, int32_t label)
  *  FAT chain: 1 -> 3 -> 5 -> 2 -> FAT_FILE_END
  *  Cluster chain: {1, 3, 5, 2}
  */
-std::vector<int> FileSystem::getFatClusterChain(int fromCluster, int fileSize) {
-    int clusterCount = getNeededClustersCount(fileSize);
+std::vector<int> FileSystem::getFatClusterChain(int fromCluster, int64_t fileSize) {
+    int clusterCount = std::max(1, getNeededClustersCount(fileSize)); // empty file still holds a cluster
 
     if (clusterCount > mBootSector.mClusterCount)
         throw std::runtime_error("internal error, incorrect cluster count");
@@ -454,6 +854,8 @@ std::vector<int> FileSystem::getFatClusterChain(int fromCluster, int fileSize) {
         curCluster = readFromFatByCluster(curCluster);
         if (isSpecialLabel(curCluster) || curCluster >= mBootSector.mClusterCount) break;
     }
+    if (isSpecialLabel(curCluster) || curCluster < 0 || curCluster >= mBootSector.mClusterCount)
+        throw std::runtime_error("filesystem corrupted");
     clusters.push_back(curCluster);
     int lastLabel = readFromFatByCluster(curCluster);
     if (clusters.size() != clusterCount || lastLabel != FAT_FILE_END)
@@ -462,48 +864,458 @@ std::vector<int> FileSystem::getFatClusterChain(int fromCluster, int fileSize) {
     return clusters;
 }
 
-void FileSystem::writeFile(std::vector<int> &clusters, std::vector<char> &buffer) {
-    int filesSize = static_cast<int>(buffer.size());
+/**
+ * Returns FAT cluster chain of a directory (or any chain), i.e. follows the
+ * labels until FAT_FILE_END.
+ */
+std::vector<int> FileSystem::getFatClusterChain(int fromCluster) {
+    std::vector<int> clusters{};
+    int curCluster = fromCluster;
+    while (true) {
+        if (isSpecialLabel(curCluster) || curCluster < 0 || curCluster >= mBootSector.mClusterCount ||
+            clusters.size() >= mBootSector.mClusterCount)
+            throw std::runtime_error(CORRUPTED_FS_ERROR);
+        clusters.push_back(curCluster);
+        curCluster = readFromFatByCluster(curCluster);
+        if (curCluster == FAT_FILE_END) break;
+    }
+    return clusters;
+}
+
+/**
+ * Walks the whole directory tree and counts entries flagged as shared.
+ */
+void FileSystem::buildReferenceCounts() {
+    std::vector<int> sharedChains{};
+    walkFiles([&sharedChains](int, const DirectoryEntryRecord &record) {
+        if (record.isShared()) sharedChains.push_back(record.mStartCluster);
+    });
+    mReferenceCounts.build(sharedChains);
+}
+
+/**
+ * Makes `copy` reference cluster chain of `source` (reflink), both entries
+ * are flagged as shared. `copy` isn't written by this method.
+ */
+void FileSystem::shareFileChain(int parentCluster, DirectoryEntry &source, DirectoryEntry &copy) {
+    if (!mReferenceCounts.isBuilt()) buildReferenceCounts();
+
+    if (!source.mIsShared) {
+        source.mIsShared = true;
+        editDirectoryEntry(parentCluster, source.mItemName, source);
+    }
+    mReferenceCounts.acquire(source.mStartCluster);
+    copy.mStartCluster = source.mStartCluster;
+    copy.mSize = source.mSize;
+    copy.mIsCompressed = source.mIsCompressed;
+    copy.mIsShared = true;
+}
+
+/**
+ * Drops reference of the entry to its cluster chain, chain is freed once
+ * nothing references it.
+ */
+void FileSystem::releaseFileChain(DirectoryEntry &de) {
+    std::vector<int> clusters{};
+    releaseFileChain(de, clusters);
+    labelFatClusterChain(clusters, FAT_UNUSED);
+}
+
+/**
+ * Same as above, clusters to free are only appended to `freedClusters` so
+ * more chains can be freed in one batch.
+ */
+void FileSystem::releaseFileChain(DirectoryEntry &de, std::vector<int> &freedClusters) {
+    if (de.mIsShared) {
+        if (!mReferenceCounts.isBuilt()) buildReferenceCounts();
+        if (mReferenceCounts.release(de.mStartCluster) > 0) return;
+    }
+    auto clusters = getFatClusterChain(de.mStartCluster, de.mSize);
+    freedClusters.insert(freedClusters.end(), clusters.begin(), clusters.end());
+}
+
+/**
+ * Calls visitor for every file in the directory tree.
+ */
+void FileSystem::walkFiles(const std::function<void(int parentCluster, const DirectoryEntryRecord &record)> &visitor) {
+    std::vector<int> pending{0}; // root directory
+    while (!pending.empty()) {
+        int cluster = pending.back();
+        pending.pop_back();
+
+        std::vector<int> clusters{};
+        std::vector<DirectoryEntryRecord> entries{};
+        readDirectory(cluster, clusters, entries);
+        for (size_t i = DEFAULT_DIR_SIZE; i < entries.size(); i++) {
+            if (entries[i].isFile()) {
+                visitor(cluster, entries[i]);
+            } else {
+                pending.push_back(entries[i].mStartCluster);
+            }
+        }
+    }
+}
+
+uint64_t FileSystem::hashFile(const std::vector<int> &clusters, int64_t fileSize) {
+    size_t clusterSize = mBootSector.mClusterSize;
+    std::vector<char> buffer(std::min(IO_BUFFER_CLUSTERS * clusterSize, static_cast<size_t>(fileSize)));
+
+    uint64_t hash = HASH_OFFSET_BASIS;
+    size_t remaining = fileSize;
+    for (size_t first = 0; remaining > 0; first += IO_BUFFER_CLUSTERS) {
+        size_t count = std::min(remaining, buffer.size());
+        readClusters(clusters, first, buffer.data(), count);
+        hash = hashBytes(buffer.data(), count, hash);
+        remaining -= count;
+    }
+    return hash;
+}
+
+/**
+ * Hashes `fileSize` bytes of the stream and rewinds it.
+ */
+uint64_t FileSystem::hashStream(std::istream &stream, int64_t fileSize) {
+    std::vector<char> buffer(std::min<int64_t>(IO_BUFFER_CLUSTERS * mBootSector.mClusterSize, fileSize));
+
+    uint64_t hash = HASH_OFFSET_BASIS;
+    size_t remaining = fileSize;
+    while (remaining > 0) {
+        size_t count = std::min(remaining, buffer.size());
+        if (!stream.read(buffer.data(), static_cast<std::streamsize>(count)))
+            throw std::runtime_error(FILE_READ_ERROR);
+        hash = hashBytes(buffer.data(), count, hash);
+        remaining -= count;
+    }
+    stream.clear();
+    stream.seekg(0, std::ios::beg);
+    return hash;
+}
+
+/**
+ * Compares file contents with `fileSize` bytes of the stream and rewinds it.
+ */
+bool FileSystem::compareFile(const std::vector<int> &clusters, int64_t fileSize, std::istream &stream) {
+    size_t clusterSize = mBootSector.mClusterSize;
+    size_t bufferSize = std::min(IO_BUFFER_CLUSTERS * clusterSize, static_cast<size_t>(fileSize));
+    std::vector<char> fileBuffer(bufferSize), streamBuffer(bufferSize);
+
+    bool equal = true;
+    size_t remaining = fileSize;
+    for (size_t first = 0; equal && remaining > 0; first += IO_BUFFER_CLUSTERS) {
+        size_t count = std::min(remaining, bufferSize);
+        readClusters(clusters, first, fileBuffer.data(), count);
+        if (!stream.read(streamBuffer.data(), static_cast<std::streamsize>(count)))
+            throw std::runtime_error(FILE_READ_ERROR);
+        equal = !memcmp(fileBuffer.data(), streamBuffer.data(), count);
+        remaining -= count;
+    }
+    stream.clear();
+    stream.seekg(0, std::ios::beg);
+    return equal;
+}
+
+bool FileSystem::compareFiles(const std::vector<int> &first, const std::vector<int> &second, int64_t fileSize) {
+    size_t clusterSize = mBootSector.mClusterSize;
+    size_t bufferSize = std::min(IO_BUFFER_CLUSTERS * clusterSize, static_cast<size_t>(fileSize));
+    std::vector<char> firstBuffer(bufferSize), secondBuffer(bufferSize);
+
+    size_t remaining = fileSize;
+    for (size_t cluster = 0; remaining > 0; cluster += IO_BUFFER_CLUSTERS) {
+        size_t count = std::min(remaining, bufferSize);
+        readClusters(first, cluster, firstBuffer.data(), count);
+        readClusters(second, cluster, secondBuffer.data(), count);
+        if (memcmp(firstBuffer.data(), secondBuffer.data(), count) != 0) return false;
+        remaining -= count;
+    }
+    return true;
+}
+
+/**
+ * Hashes contents of every non-empty file of the image.
+ */
+void FileSystem::buildContentIndex() {
+    mContentIndex.clear();
+    std::unordered_map<int, uint64_t> chainHashes{}; // shared chains are hashed once
+    walkFiles([this, &chainHashes](int parentCluster, const DirectoryEntryRecord &record) {
+        if (record.mSize <= 0 || record.isCompressed()) return;
+        auto it = chainHashes.find(record.mStartCluster);
+        if (it == chainHashes.end()) {
+            auto clusters = getFatClusterChain(record.mStartCluster, record.mSize);
+            it = chainHashes.emplace(record.mStartCluster, hashFile(clusters, record.mSize)).first;
+        }
+        indexFile(it->second, parentCluster, DirectoryEntry(record));
+    });
+    mContentIndex.markBuilt();
+}
+
+/**
+ * Looks up a file with the same contents as the stream.
+ * @param parentCluster, de Set to the found file.
+ */
+bool FileSystem::findDuplicate(uint64_t contentHash, int64_t fileSize, std::istream &stream, int &parentCluster,
+                               DirectoryEntry &de) {
+    if (!mContentIndex.isBuilt()) buildContentIndex();
+
+    auto key = ContentIndex::key(contentHash, fileSize);
+    for (auto &location: mContentIndex.find(key)) {
+        // location might be stale, the file could have been moved or removed since
+        if (!findDirectoryEntry(location.mParentCluster, location.mItemName, de, EFileOption::FILE)
+            || de.mStartCluster != location.mStartCluster || de.mSize != fileSize) {
+            mContentIndex.erase(key, location);
+            continue;
+        }
+        auto clusters = getFatClusterChain(de.mStartCluster, de.mSize);
+        if (compareFile(clusters, fileSize, stream)) {
+            parentCluster = location.mParentCluster;
+            return true;
+        }
+    }
+    return false;
+}
 
-    if (!filesSize) return;
+void FileSystem::indexFile(uint64_t contentHash, int parentCluster, const DirectoryEntry &de) {
+    auto itemName = std::string(de.mItemName.c_str());
+    mContentIndex.insert(ContentIndex::key(contentHash, de.mSize), {parentCluster, itemName, de.mStartCluster});
+}
+
+/**
+ * Merges files with identical contents into shared cluster chains.
+ * @return Count of freed clusters.
+ */
+int FileSystem::deduplicate() {
+    struct FileRef {
+        int mParentCluster;
+        DirectoryEntry mEntry;
+    };
+
+    // only files of the same size can be duplicates
+    std::unordered_map<int64_t, std::vector<FileRef>> sizeGroups{};
+    walkFiles([&sizeGroups](int parentCluster, const DirectoryEntryRecord &record) {
+        if (record.mSize > 0) sizeGroups[record.mSize].push_back({parentCluster, DirectoryEntry(record)});
+    });
+
+    // frees may be deferred until commit, so the released chains are counted
+    std::vector<int> freedClusters{};
+    for (auto &sizeGroup: sizeGroups) {
+        auto &files = sizeGroup.second;
+        if (files.size() < 2) continue;
+
+        std::map<std::pair<uint64_t, bool>, size_t> canonical{}; // (content hash, compressed) -> first such file
+        std::unordered_map<int, uint64_t> chainHashes{};
+        for (size_t i = 0; i < files.size(); i++) {
+            auto &file = files[i].mEntry;
+            auto clusters = getFatClusterChain(file.mStartCluster, file.mSize);
+            auto hashIt = chainHashes.find(file.mStartCluster);
+            if (hashIt == chainHashes.end())
+                hashIt = chainHashes.emplace(file.mStartCluster, hashFile(clusters, file.mSize)).first;
+
+            auto key = std::make_pair(hashIt->second, file.mIsCompressed);
+            auto it = canonical.find(key);
+            if (it == canonical.end()) {
+                canonical.emplace(key, i);
+                continue;
+            }
 
-    int clusterSize = mBootSector.mClusterSize;
-    int trailingBytes = filesSize % clusterSize;
-    trailingBytes = trailingBytes ? trailingBytes : clusterSize;
+            auto &source = files[it->second];
+            if (source.mEntry.mStartCluster == file.mStartCluster) continue;
+            auto sourceClusters = getFatClusterChain(source.mEntry.mStartCluster, source.mEntry.mSize);
+            if (!compareFiles(sourceClusters, clusters, file.mSize)) continue;
 
-    for (int i = 0; i < clusters.size() - 1; i++) {
-        seekStreamToDataCluster(clusters.at(i));
-        mStream.write((char *) (&buffer[i * clusterSize]), clusterSize);
+            releaseFileChain(file, freedClusters);
+            shareFileChain(source.mParentCluster, source.mEntry, file);
+            editDirectoryEntry(files[i].mParentCluster, file.mItemName, file);
+        }
     }
-    seekStreamToDataCluster(clusters.back());
-    mStream.write((char *) (&buffer[filesSize - trailingBytes]), trailingBytes);
+    labelFatClusterChain(freedClusters, FAT_UNUSED);
+    mContentIndex.clear();
     flush();
+    return static_cast<int>(freedClusters.size());
 }
 
-std::vector<char> FileSystem::readFile(std::vector<int> &clusters, int fileSize) {
-    int clusterSize = mBootSector.mClusterSize;
-    int trailingBytes = fileSize % clusterSize;
-    trailingBytes = trailingBytes ? trailingBytes : clusterSize;
+/**
+ * Counts physically consecutive clusters starting with clusters[first],
+ * at most `maxLength` of them.
+ */
+size_t FileSystem::getRunLength(const std::vector<int> &clusters, size_t first, size_t maxLength) {
+    size_t length = 1;
+    while (length < maxLength && first + length < clusters.size()
+           && clusters[first + length] == clusters[first + length - 1] + 1)
+        length++;
+    return length;
+}
 
-    std::vector<char> buffer(fileSize);
-    for (int i = 0; i < clusters.size() - 1; i++) {
-        seekStreamToDataCluster(clusters.at(i));
-        mStream.read((char *) (&buffer[i * clusterSize]), clusterSize);
+/**
+ * Writes `size` bytes into clusters starting with clusters[first], data are
+ * laid out cluster by cluster. Consecutive clusters are written at once.
+ */
+void FileSystem::writeClusters(const std::vector<int> &clusters, size_t first, const char *data, size_t size) {
+    size_t clusterSize = mBootSector.mClusterSize;
+    for (size_t i = first; size > 0;) {
+        size_t length = getRunLength(clusters, i, (size + clusterSize - 1) / clusterSize);
+        size_t count = std::min(size, length * clusterSize);
+        mStorage->writeAt(clusterToDataAddress(clusters.at(i)), data, count);
+        data += count;
+        size -= count;
+        i += length;
+    }
+}
+
+void FileSystem::writeFile(std::vector<int> &clusters, std::vector<char> &buffer) {
+    if (buffer.empty()) return;
+
+    writeClusters(clusters, 0, buffer.data(), buffer.size());
+    flush();
+}
+
+/**
+ * Streams `fileSize` bytes from input stream into clusters through a buffer
+ * of IO_BUFFER_CLUSTERS clusters, memory usage doesn't depend on file size.
+ */
+void FileSystem::writeFile(std::vector<int> &clusters, std::istream &stream, int64_t fileSize) {
+    size_t chunkClusters = IO_BUFFER_CLUSTERS;
+    size_t clusterSize = mBootSector.mClusterSize;
+    std::vector<char> buffer(std::min(chunkClusters * clusterSize, static_cast<size_t>(fileSize)));
+
+    size_t remaining = fileSize;
+    for (size_t first = 0; remaining > 0; first += chunkClusters) {
+        size_t count = std::min(remaining, buffer.size());
+        if (!stream.read(buffer.data(), static_cast<std::streamsize>(count)))
+            throw std::runtime_error(FILE_READ_ERROR);
+        writeClusters(clusters, first, buffer.data(), count);
+        remaining -= count;
     }
-    seekStreamToDataCluster(clusters.back());
-    mStream.read((char *) (&buffer[fileSize - trailingBytes]), trailingBytes);
+    flush();
+}
+
+/**
+ * Reads `size` bytes from clusters starting with clusters[first], consecutive
+ * clusters are read at once.
+ */
+void FileSystem::readClusters(const std::vector<int> &clusters, size_t first, char *data, size_t size) {
+    size_t clusterSize = mBootSector.mClusterSize;
+    for (size_t i = first; size > 0;) {
+        size_t length = getRunLength(clusters, i, (size + clusterSize - 1) / clusterSize);
+        size_t count = std::min(size, length * clusterSize);
+        mStorage->readAt(clusterToDataAddress(clusters.at(i)), data, count);
+        data += count;
+        size -= count;
+        i += length;
+    }
+}
+
+std::vector<char> FileSystem::readFile(std::vector<int> &clusters, int64_t fileSize) {
+    std::vector<char> buffer(fileSize);
+    readClusters(clusters, 0, buffer.data(), buffer.size());
     return buffer;
 }
 
+/**
+ * Streams file data into output stream in blocks of IO_BUFFER_CLUSTERS
+ * clusters, memory usage doesn't depend on file size.
+ */
+void FileSystem::readFile(std::vector<int> &clusters, int64_t fileSize, std::ostream &stream) {
+    size_t chunkClusters = IO_BUFFER_CLUSTERS;
+    size_t clusterSize = mBootSector.mClusterSize;
+    std::vector<char> buffer(std::min(chunkClusters * clusterSize, static_cast<size_t>(fileSize)));
+
+    size_t remaining = fileSize;
+    for (size_t first = 0; remaining > 0; first += chunkClusters) {
+        size_t count = std::min(remaining, buffer.size());
+        readClusters(clusters, first, buffer.data(), count);
+        stream.write(buffer.data(), static_cast<std::streamsize>(count));
+        remaining -= count;
+    }
+}
+
+/**
+ * Copies file data into host file descriptor. Cluster chain is coalesced
+ * into runs of consecutive clusters and each run is handed to the kernel
+ * as one range copy from the image file (see copyFileRange). Several
+ * files may be exported at once, nothing is flushed here since commands
+ * writing file data flush them.
+ */
+void FileSystem::exportFile(std::vector<int> &clusters, int64_t fileSize, int fd) {
+    int imageFd = open(mFileName.c_str(), O_RDONLY);
+    if (imageFd < 0)
+        throw std::runtime_error(FS_OPEN_ERROR);
+
+    try {
+        int64_t remaining = fileSize, outOffset = 0;
+        for (auto &run: getClusterRuns(clusters)) {
+            if (remaining <= 0) break;
+            auto size = std::min<int64_t>(remaining, static_cast<int64_t>(run.mLength) * mBootSector.mClusterSize);
+            copyFileRange(imageFd, clusterToDataAddress(run.mStartCluster), fd, outOffset, size);
+            outOffset += size;
+            remaining -= size;
+        }
+    } catch (...) {
+        close(imageFd);
+        throw;
+    }
+    close(imageFd);
+}
+
+/**
+ * Copies host file into clusters allocated for it, through the kernel where
+ * possible. Touches neither the storage object nor metadata, so several
+ * threads may import different files at once.
+ */
+void FileSystem::importFile(const std::vector<int> &clusters, int64_t fileSize, int fd) {
+    int imageFd = open(mFileName.c_str(), O_WRONLY);
+    if (imageFd < 0)
+        throw std::runtime_error(FS_OPEN_ERROR);
+
+    try {
+        int64_t remaining = fileSize, inOffset = 0;
+        for (auto &run: getClusterRuns(clusters)) {
+            if (remaining <= 0) break;
+            auto size = std::min<int64_t>(remaining, static_cast<int64_t>(run.mLength) * mBootSector.mClusterSize);
+            copyFileRange(fd, inOffset, imageFd, clusterToDataAddress(run.mStartCluster), size);
+            inOffset += size;
+            remaining -= size;
+        }
+    } catch (...) {
+        close(imageFd);
+        throw;
+    }
+    close(imageFd);
+}
+
+/**
+ * Copies file data between two cluster chains of the image through the
+ * kernel, one range per part where both chains are consecutive. Like
+ * importFile it may run for several files at once, fs must be flushed first.
+ */
+void FileSystem::copyFile(const std::vector<int> &from, const std::vector<int> &to, int64_t fileSize) {
+    int imageFd = open(mFileName.c_str(), O_RDWR);
+    if (imageFd < 0)
+        throw std::runtime_error(FS_OPEN_ERROR);
+
+    try {
+        int64_t remaining = fileSize;
+        for (size_t i = 0; remaining > 0;) {
+            size_t length = std::min(getRunLength(from, i, from.size()), getRunLength(to, i, to.size()));
+            auto size = std::min<int64_t>(remaining, static_cast<int64_t>(length) * mBootSector.mClusterSize);
+            copyFileRange(imageFd, clusterToDataAddress(from[i]), imageFd, clusterToDataAddress(to[i]), size);
+            remaining -= size;
+            i += length;
+        }
+    } catch (...) {
+        close(imageFd);
+        throw;
+    }
+    close(imageFd);
+}
+
 DirectoryEntry
 FileSystem::getLastRelativeDirectoryEntry(std::vector<std::string> &fileNames, EFileOption lastEntryOpt) {
-    if (fileNames.empty()) return mWorkingDirectory;
+    if (fileNames.empty()) return getWorkingDirectory();
 
     if (fileNames.empty())
         throw std::runtime_error("received empty path");
 
     DirectoryEntry parentDE{};
-    int curCluster = mWorkingDirectory.mStartCluster;
+    int curCluster = getWorkingDirectory().mStartCluster;
     for (int i = 0; i < fileNames.size() - 1; i++) {
         if (findDirectoryEntry(curCluster, fileNames.at(i), parentDE, false)) {
             curCluster = parentDE.mStartCluster;
@@ -523,7 +1335,108 @@ FileSystem::getLastRelativeDirectoryEntry(std::vector<std::string> &fileNames, E
     return parentDE;
 }
 
+/**
+ * Reads `size` bytes of file data at any byte offset.
+ */
+void FileSystem::readFileData(const std::vector<int> &clusters, int64_t offset, char *data, size_t size) {
+    size_t clusterSize = mBootSector.mClusterSize;
+    size_t first = offset / clusterSize, skip = offset % clusterSize;
+    if (skip && size) {
+        size_t count = std::min(size, clusterSize - skip);
+        mStorage->readAt(clusterToDataAddress(clusters.at(first)) + skip, data, count);
+        data += count;
+        size -= count;
+        first++;
+    }
+    readClusters(clusters, first, data, size);
+}
 
+/**
+ * Writes `size` bytes of file data at any byte offset.
+ */
+void FileSystem::writeFileData(const std::vector<int> &clusters, int64_t offset, const char *data, size_t size) {
+    size_t clusterSize = mBootSector.mClusterSize;
+    size_t first = offset / clusterSize, skip = offset % clusterSize;
+    if (skip && size) {
+        size_t count = std::min(size, clusterSize - skip);
+        mStorage->writeAt(clusterToDataAddress(clusters.at(first)) + skip, data, count);
+        data += count;
+        size -= count;
+        first++;
+    }
+    writeClusters(clusters, first, data, size);
+}
 
+/**
+ * Compresses `fileSize` bytes of the stream chunk by chunk into clusters,
+ * clusters must fit the worst case (chunk table + file size).
+ * @return Stored size, the clusters after it aren't used.
+ */
+int64_t FileSystem::writeCompressedFile(std::vector<int> &clusters, std::istream &stream, int64_t fileSize) {
+    CompressedFile layout{static_cast<uint64_t>(fileSize)};
+    std::vector<char> chunk(CompressedFile::CHUNK_SIZE);
+    std::vector<char> compressed(lzCompressBound(CompressedFile::CHUNK_SIZE));
+
+    int64_t offset = layout.tableSize();
+    for (size_t i = 0; i < layout.chunkCount(); i++) {
+        auto size = layout.chunkSize(i);
+        if (!stream.read(chunk.data(), size))
+            throw std::runtime_error(FILE_READ_ERROR);
+
+        // chunks which don't get smaller are stored as they are
+        auto storedSize = static_cast<uint32_t>(lzCompress(chunk.data(), size, compressed.data(), size - 1));
+        bool raw = !storedSize;
+        if (raw) storedSize = size;
+
+        writeFileData(clusters, offset, raw ? chunk.data() : compressed.data(), storedSize);
+        layout.setChunk(i, storedSize, raw);
+        offset += storedSize;
+    }
 
+    auto table = layout.serializeTable();
+    writeFileData(clusters, 0, table.data(), table.size());
+    flush();
+    return layout.seal();
+}
+
+CompressedFile FileSystem::readCompressedLayout(const std::vector<int> &clusters, int64_t storedSize) {
+    if (storedSize < static_cast<int>(CompressedFile::HEADER_SIZE))
+        throw std::runtime_error(CORRUPTED_FS_ERROR);
+
+    char header[CompressedFile::HEADER_SIZE];
+    readFileData(clusters, 0, header, CompressedFile::HEADER_SIZE);
+    auto layout = CompressedFile::fromHeader(header);
+    if (layout.tableSize() > static_cast<size_t>(storedSize))
+        throw std::runtime_error(CORRUPTED_FS_ERROR);
+
+    std::vector<char> table(layout.tableSize() - CompressedFile::HEADER_SIZE);
+    readFileData(clusters, CompressedFile::HEADER_SIZE, table.data(), table.size());
+    layout.readTable(table.data());
+    if (layout.seal() > storedSize)
+        throw std::runtime_error(CORRUPTED_FS_ERROR);
+    return layout;
+}
+
+/**
+ * Reads and decompresses a single chunk, chunks are independent so this
+ * gives random access into compressed file.
+ */
+std::vector<char> FileSystem::readCompressedChunk(const std::vector<int> &clusters, const CompressedFile &layout,
+                                                  size_t chunk) {
+    std::vector<char> stored(layout.storedSize(chunk));
+    readFileData(clusters, layout.chunkOffset(chunk), stored.data(), stored.size());
+    if (layout.isRaw(chunk)) return stored;
+
+    std::vector<char> data(layout.chunkSize(chunk));
+    if (lzDecompress(stored.data(), stored.size(), data.data(), data.size()) != data.size())
+        throw std::runtime_error(CORRUPTED_FS_ERROR);
+    return data;
+}
 
+void FileSystem::readCompressedFile(std::vector<int> &clusters, int64_t storedSize, std::ostream &stream) {
+    auto layout = readCompressedLayout(clusters, storedSize);
+    for (size_t i = 0; i < layout.chunkCount(); i++) {
+        auto data = readCompressedChunk(clusters, layout, i);
+        stream.write(data.data(), static_cast<std::streamsize>(data.size()));
+    }
+}
@@ -3,15 +3,26 @@
 
 #include "definitions.h"
 #include "BootSector.h"
+#include "CompressedFile.h"
+#include "ContentIndex.h"
+#include "DentryCache.h"
 #include "DirectoryEntry.h"
-#include <fstream>
+#include "DirectoryIndex.h"
+#include "FAT.h"
+#include "FreeClusterBitmap.h"
+#include "FreeExtentIndex.h"
+#include "IStorage.h"
+#include "Journal.h"
+#include "ReferenceCountTable.h"
+#include "Session.h"
+#include <functional>
+#include <istream>
+#include <ostream>
+#include <memory>
+#include <mutex>
 #include <queue>
-
-enum class EFileOption {
-    FILE,
-    DIRECTORY,
-    UNSPECIFIED,
-};
+#include <set>
+#include <shared_mutex>
 
 class InvalidOptionException : public std::exception {
 private:
@@ -23,12 +34,26 @@ public:
 
     explicit InvalidOptionException(const std::string &errMsg) : mErrMsg(errMsg) {}
 
-    const char *what() const _NOEXCEPT override {
+    const char *what() const noexcept override {
         return this->mErrMsg.c_str();
     }
 };
 
-constexpr int MAX_ENTRIES = CLUSTER_SIZE / DirectoryEntry::SIZE;
+/**
+ * Run of physically consecutive clusters.
+ */
+struct ClusterRun {
+    int mStartCluster;
+    int mLength;
+};
+
+/**
+ * FAT label change of one cluster.
+ */
+struct FatLabel {
+    int mCluster;
+    int32_t mLabel;
+};
 
 /**
  * FS MEMORY STRUCTURE:
@@ -36,48 +61,223 @@ constexpr int MAX_ENTRIES = CLUSTER_SIZE / DirectoryEntry::SIZE;
  * BOOT SECTOR
  * FAT1
  * FAT2
- * padding (0 <= padding < CLUSTER_SIZE), fill value: \00
+ * JOURNAL (since version 2)
+ * padding (0 <= padding < cluster size), fill value: \00
  * DATA
  */
+
 class FileSystem {
     const std::string mFileName;
-    std::fstream mStream;
-    std::string mWorkingDirectoryPath{"/"};
+    const EStorageType mStorageType;
+    std::unique_ptr<IStorage> mStorage;
+    std::unique_ptr<Journal> mJournal; // metadata writes and reads go through the journal
+    int mGroupCommitDepth = 0;
+    bool mBatch = false;
+    DirectoryEntry mBatchWorkingDirectory;
+    std::vector<int> mPendingFreeClusters; // freed by uncommitted transactions, not reusable yet
+    size_t mEndedFreeCount = 0; // leading pending clusters freed by transactions already ended
+    FAT mFat;
+    FreeClusterBitmap mFreeClusters;
+    FreeExtentIndex mFreeExtents;
+    DentryCache mDentryCache;
+    DirectoryIndex mDirectoryIndex;
+    ReferenceCountTable mReferenceCounts;
+    ContentIndex mContentIndex;
+    const bool mDeduplicate;
+    DirectoryEntry mRootDirectory;
+    Session mConsoleSession;
+    std::set<Session *> mSessions; // opened besides the console one
+    std::mutex mSessionMutex;
+    std::shared_timed_mutex mCommandLock;
+    std::mutex mCacheMutex; // dentry cache and directory index, filled by concurrent readers
 public:
+    /**
+     * Holds the fs for one command. Read-only commands share it and run in
+     * parallel, the others get it exclusively. Commands nested in a script
+     * (load) run under the lock of the script.
+     */
+    class CommandLock {
+        FileSystem &mFS;
+        const bool mExclusive;
+        const bool mOwner;
+    public:
+        CommandLock(FileSystem &fs, bool exclusive);
+
+        ~CommandLock();
+
+        CommandLock(const CommandLock &) = delete;
+
+        CommandLock &operator=(const CommandLock &) = delete;
+    };
+
+    /**
+     * Binds a session to the calling thread for its lifetime.
+     */
+    class SessionScope {
+        Session *const mPrevious;
+    public:
+        explicit SessionScope(Session &session);
+
+        ~SessionScope();
+
+        SessionScope(const SessionScope &) = delete;
+
+        SessionScope &operator=(const SessionScope &) = delete;
+    };
+
+
     BootSector mBootSector;
-    DirectoryEntry mWorkingDirectory;
 
-    explicit FileSystem(std::string &fileName);
+    explicit FileSystem(std::string &fileName, EStorageType storageType = EStorageType::STREAM,
+                        bool deduplicate = false);
+
+    ~FileSystem();
 
     friend std::ostream &operator<<(std::ostream &os, FileSystem const &fs);
 
     void readVFS();
 
-    void formatFS(int diskSize = DEFAULT_FORMAT_SIZE);
+    void loadMetadata();
+
+    void formatFS(int diskSize = DEFAULT_FORMAT_SIZE, int clusterSize = DEFAULT_CLUSTER_SIZE);
+
+    void openJournal();
 
     void flush();
 
-    void seek(int pos);
+    /**
+     * @return False if the storage can't serve reads from several threads (shared stream cursor).
+     */
+    bool supportsConcurrentReads() const { return mStorageType != EStorageType::STREAM; }
+
+    // TRANSACTIONS
+
+    void endTransaction();
+
+    void abortTransaction();
+
+    void commit();
+
+    void commitEndedTransactions();
+
+    void releasePendingFreeClusters(size_t count);
+
+    void beginGroupCommit();
+
+    void endGroupCommit();
+
+    void beginBatch();
+
+    void endBatch();
+
+    void rollbackBatch();
+
+    bool isBatch() const { return mBatch; }
+
+    void seek(int64_t pos);
 
     void seekStreamToDataCluster(int cluster);
 
-    int clusterToDataAddress(int cluster) const;
+    int64_t clusterToDataAddress(int cluster) const;
 
-    int clusterToFatAddress(int cluster) const;
+    int64_t clusterToFatAddress(int cluster) const;
+
+    /**
+     * @return Number of directory entries fitting one cluster.
+     */
+    int getClusterEntryCount() const;
+
+    void writeClusters(const std::vector<int> &clusters, size_t first, const char *data, size_t size);
 
     void writeFile(std::vector<int> &clusters, std::vector<char> &buffer);
 
-    std::vector<char> readFile(std::vector<int> &clusters, int fileSize);
+    void writeFile(std::vector<int> &clusters, std::istream &stream, int64_t fileSize);
+
+    void readClusters(const std::vector<int> &clusters, size_t first, char *data, size_t size);
+
+    std::vector<char> readFile(std::vector<int> &clusters, int64_t fileSize);
+
+    void readFile(std::vector<int> &clusters, int64_t fileSize, std::ostream &stream);
+
+    void exportFile(std::vector<int> &clusters, int64_t fileSize, int fd);
+
+    void importFile(const std::vector<int> &clusters, int64_t fileSize, int fd);
+
+    void copyFile(const std::vector<int> &from, const std::vector<int> &to, int64_t fileSize);
+
+    void readFileData(const std::vector<int> &clusters, int64_t offset, char *data, size_t size);
+
+    void writeFileData(const std::vector<int> &clusters, int64_t offset, const char *data, size_t size);
+
+    // COMPRESSED FILES
+
+    int64_t writeCompressedFile(std::vector<int> &clusters, std::istream &stream, int64_t fileSize);
+
+    CompressedFile readCompressedLayout(const std::vector<int> &clusters, int64_t storedSize);
+
+    std::vector<char> readCompressedChunk(const std::vector<int> &clusters, const CompressedFile &layout, size_t chunk);
+
+    void readCompressedFile(std::vector<int> &clusters, int64_t storedSize, std::ostream &stream);
+
+    // SESSIONS
+
+    /**
+     * @return Session bound to the calling thread, the console session if there is none.
+     */
+    Session &getSession();
+
+    /**
+     * Registers a new session starting in the root directory.
+     */
+    void openSession(Session &session);
+
+    void closeSession(Session &session);
+
+    /**
+     * Moves all sessions to the (new) root directory, the fs was formatted or reloaded.
+     */
+    void resetSessions(const DirectoryEntry &rootDirectory);
+
+    /**
+     * @return True if the directory is the working directory of a session other than the calling one.
+     */
+    bool isWorkingDirectoryOfOtherSession(int cluster);
 
     // DIRECTORY OPERATIONS
 
+    const DirectoryEntry &getWorkingDirectory();
+
+    void setWorkingDirectory(const DirectoryEntry &de);
+
     void updateWorkingDirectoryPath();
 
     std::string getWorkingDirectoryPath();
 
+    int readDirectory(int cluster, std::vector<int> &clusters, std::vector<DirectoryEntryRecord> &entries);
+
+    std::shared_ptr<DirectoryIndex::Directory> getIndexedDirectory(int cluster);
+
+    void writeDirectoryEntryAt(const DirectoryIndex::Directory &directory, int slot,
+                               const DirectoryEntryRecord &record);
+
+    void growDirectory(DirectoryIndex::Directory &directory);
+
+    void shrinkDirectory(DirectoryIndex::Directory &directory);
+
     bool getDirectory(int cluster, DirectoryEntry &de);
 
-    int getDirectoryNextFreeEntryAddress(int cluster);
+    /**
+     * Creates empty directory `name` in the parent directory, doesn't check if it exists.
+     * @return Entry of the new directory.
+     */
+    DirectoryEntry makeDirectory(DirectoryEntry parentDE, const std::string &name);
+
+    /**
+     * @return Clusters of the directory and of all directories below it, parents first.
+     */
+    std::vector<int> getDirectoryTree(int cluster);
+
+    void releaseDirectoryTree(const std::vector<int> &directories);
 
     std::vector<std::string> getDirectoryContents(int directoryCluster);
 
@@ -87,6 +287,8 @@ public:
 
     bool findDirectoryEntry(int cluster, const std::string &itemName, DirectoryEntry &de, bool isFile);
 
+    bool findDirectoryEntry(int cluster, const std::string &itemName, DirectoryEntry &de, EFileOption option);
+
     bool findDirectoryEntry(int parentCluster, int childCluster, DirectoryEntry &de);
 
     void writeNewDirectoryEntry(int directoryCluster, DirectoryEntry &newDE);
@@ -95,6 +297,8 @@ public:
 
     bool editDirectoryEntry(int parentCluster, int childCluster, DirectoryEntry &de);
 
+    bool editDirectoryEntry(int parentCluster, const std::string &itemName, DirectoryEntry &de);
+
     bool removeDirectoryEntry(int parentCluster, const std::string &itemName, bool isFile);
 
     bool directoryEntryExists(int cluster, const std::string &itemName, bool isFile);
@@ -108,13 +312,68 @@ public:
 
     std::vector<int> getFreeClusters(int count = 1, bool ordered = false);
 
-    std::vector<int> getFatClusterChain(int fromCluster, int fileSize);
+    /**
+     * @return Free clusters, including those getFreeClusters can reuse after a commit.
+     */
+    int getFreeClusterCount() const {
+        return mFreeClusters.freeCount() + (mBatch ? 0 : static_cast<int>(mEndedFreeCount));
+    }
+
+    std::vector<int> getFatClusterChain(int fromCluster, int64_t fileSize);
+
+    std::vector<int> getFatClusterChain(int fromCluster);
 
     void makeFatChain(std::vector<int> &clusters);
 
     void labelFatClusterChain(std::vector<int> &clusters, int32_t label);
 
-    int getNeededClustersCount(int fileSize) const;
+    void writeFatLabels(std::vector<FatLabel> &labels);
+
+    // SHARED CHAINS
+
+    void buildReferenceCounts();
+
+    void shareFileChain(int parentCluster, DirectoryEntry &source, DirectoryEntry &copy);
+
+    void releaseFileChain(DirectoryEntry &de);
+
+    void releaseFileChain(DirectoryEntry &de, std::vector<int> &freedClusters);
+
+    // DEDUPLICATION
+
+    bool isDeduplicating() const { return mDeduplicate; }
+
+    void walkFiles(const std::function<void(int parentCluster, const DirectoryEntryRecord &record)> &visitor);
+
+    uint64_t hashFile(const std::vector<int> &clusters, int64_t fileSize);
+
+    uint64_t hashStream(std::istream &stream, int64_t fileSize);
+
+    bool compareFile(const std::vector<int> &clusters, int64_t fileSize, std::istream &stream);
+
+    bool compareFiles(const std::vector<int> &first, const std::vector<int> &second, int64_t fileSize);
+
+    void buildContentIndex();
+
+    bool findDuplicate(uint64_t contentHash, int64_t fileSize, std::istream &stream, int &parentCluster,
+                       DirectoryEntry &de);
+
+    void indexFile(uint64_t contentHash, int parentCluster, const DirectoryEntry &de);
+
+    int deduplicate();
+
+    int getNeededClustersCount(int64_t fileSize) const;
+
+    /**
+     * @return Largest file size the mounted fs version can record.
+     */
+    int64_t getMaxFileSize() const;
+
+    static std::vector<ClusterRun> getClusterRuns(const std::vector<int> &clusters);
+
+    static size_t getRunLength(const std::vector<int> &clusters, size_t first, size_t maxLength);
+
+    std::vector<int> findFreeClusters(int count, bool ordered) const;
 
     void writeToFatByCluster(int cluster, int label);
 
@@ -0,0 +1,64 @@
+#include "FreeClusterBitmap.h"
+#include "definitions.h"
+
+#include <algorithm>
+
+void FreeClusterBitmap::build(const FAT &fat) {
+    mClusterCount = fat.size();
+    mWords.assign((mClusterCount + WORD_BITS - 1) / WORD_BITS, 0);
+    mFreeCount = 0;
+    mFirstFreeWord = 0;
+    for (int32_t i = 0; i < mClusterCount; i++) {
+        if (fat.read(i) == FAT_UNUSED) {
+            mWords[i / WORD_BITS] |= uint64_t{1} << (i % WORD_BITS);
+            mFreeCount++;
+        }
+    }
+    while (mFirstFreeWord < mWords.size() && !mWords[mFirstFreeWord]) mFirstFreeWord++;
+}
+
+void FreeClusterBitmap::markFree(int32_t cluster) {
+    if (isFree(cluster)) return;
+    size_t word = cluster / WORD_BITS;
+    mWords[word] |= uint64_t{1} << (cluster % WORD_BITS);
+    mFreeCount++;
+    if (word < mFirstFreeWord) mFirstFreeWord = word;
+}
+
+void FreeClusterBitmap::markUsed(int32_t cluster) {
+    if (!isFree(cluster)) return;
+    mWords[cluster / WORD_BITS] &= ~(uint64_t{1} << (cluster % WORD_BITS));
+    mFreeCount--;
+    while (mFirstFreeWord < mWords.size() && !mWords[mFirstFreeWord]) mFirstFreeWord++;
+}
+
+int32_t FreeClusterBitmap::nextFree(int32_t from) const {
+    if (from >= mClusterCount) return mClusterCount;
+    size_t word = from / WORD_BITS;
+    uint64_t bits;
+    if (word < mFirstFreeWord) {
+        word = mFirstFreeWord;
+        if (word >= mWords.size()) return mClusterCount;
+        bits = mWords[word];
+    } else {
+        bits = mWords[word] & (~uint64_t{0} << (from % WORD_BITS));
+    }
+    while (!bits) {
+        if (++word >= mWords.size()) return mClusterCount;
+        bits = mWords[word];
+    }
+    auto cluster = static_cast<int32_t>(word * WORD_BITS + __builtin_ctzll(bits));
+    return std::min(cluster, mClusterCount);
+}
+
+int32_t FreeClusterBitmap::nextUsed(int32_t from) const {
+    if (from >= mClusterCount) return mClusterCount;
+    size_t word = from / WORD_BITS;
+    uint64_t bits = ~mWords[word] & (~uint64_t{0} << (from % WORD_BITS));
+    while (!bits) {
+        if (++word >= mWords.size()) return mClusterCount;
+        bits = ~mWords[word];
+    }
+    auto cluster = static_cast<int32_t>(word * WORD_BITS + __builtin_ctzll(bits));
+    return std::min(cluster, mClusterCount);
+}
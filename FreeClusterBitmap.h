@@ -0,0 +1,47 @@
+#ifndef ZOS_SP_FREECLUSTERBITMAP_H
+#define ZOS_SP_FREECLUSTERBITMAP_H
+
+#include "FAT.h"
+#include <cstdint>
+#include <vector>
+
+/**
+ * In-memory free space map, one bit per cluster (1 = free). Built from the
+ * FAT at mount and kept in sync with every FAT label change, so allocation
+ * never has to scan the FAT itself.
+ */
+class FreeClusterBitmap {
+private:
+    static const int WORD_BITS = 64;
+
+    std::vector<uint64_t> mWords;
+    int32_t mClusterCount = 0;
+    int32_t mFreeCount = 0;
+    size_t mFirstFreeWord = 0; // no free cluster in words before this one
+
+public:
+    void build(const FAT &fat);
+
+    bool isFree(int32_t cluster) const {
+        return (mWords[cluster / WORD_BITS] >> (cluster % WORD_BITS)) & 1u;
+    }
+
+    void markFree(int32_t cluster);
+
+    void markUsed(int32_t cluster);
+
+    int32_t freeCount() const { return mFreeCount; }
+
+    /**
+     * @return First free cluster >= from, cluster count if there is none.
+     */
+    int32_t nextFree(int32_t from) const;
+
+    /**
+     * @return First used cluster >= from, cluster count if there is none.
+     */
+    int32_t nextUsed(int32_t from) const;
+};
+
+
+#endif //ZOS_SP_FREECLUSTERBITMAP_H
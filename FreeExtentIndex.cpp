@@ -0,0 +1,77 @@
+#include "FreeExtentIndex.h"
+
+#include <algorithm>
+#include <limits>
+
+void FreeExtentIndex::insert(int32_t start, int32_t length) {
+    mByStart.emplace(start, length);
+    mByLength.emplace(length, start);
+}
+
+void FreeExtentIndex::erase(std::map<int32_t, int32_t>::iterator it) {
+    mByLength.erase({it->second, it->first});
+    mByStart.erase(it);
+}
+
+void FreeExtentIndex::build(const FreeClusterBitmap &bitmap, int32_t clusterCount) {
+    mByStart.clear();
+    mByLength.clear();
+    int32_t start = bitmap.nextFree(0);
+    while (start < clusterCount) {
+        int32_t end = bitmap.nextUsed(start);
+        insert(start, end - start);
+        start = bitmap.nextFree(end);
+    }
+}
+
+void FreeExtentIndex::markFree(int32_t start, int32_t length) {
+    auto next = mByStart.find(start + length);
+    if (next != mByStart.end()) {
+        length += next->second;
+        erase(next);
+    }
+
+    auto prev = mByStart.lower_bound(start);
+    if (prev != mByStart.begin()) {
+        --prev;
+        if (prev->first + prev->second == start) {
+            start = prev->first;
+            length += prev->second;
+            erase(prev);
+        }
+    }
+    insert(start, length);
+}
+
+void FreeExtentIndex::markUsed(int32_t start, int32_t length) {
+    auto it = mByStart.upper_bound(start);
+    if (it == mByStart.begin()) return;
+    --it;
+
+    int32_t extentStart = it->first, extentEnd = it->first + it->second;
+    if (start >= extentEnd) return;
+
+    erase(it);
+    if (start > extentStart) insert(extentStart, start - extentStart);
+    if (start + length < extentEnd) insert(start + length, extentEnd - start - length);
+}
+
+int32_t FreeExtentIndex::bestFit(int32_t count) const {
+    auto it = mByLength.lower_bound({count, std::numeric_limits<int32_t>::min()});
+    if (it == mByLength.end()) return -1;
+    return it->second;
+}
+
+std::vector<int> FreeExtentIndex::largestFirst(int32_t count) const {
+    std::vector<int> clusters{};
+    clusters.reserve(count);
+    for (auto it = mByLength.rbegin(); it != mByLength.rend() && clusters.size() < static_cast<size_t>(count); ++it) {
+        int32_t take = std::min(it->first, count - static_cast<int32_t>(clusters.size()));
+        for (int32_t i = 0; i < take; i++) {
+            clusters.push_back(it->second + i);
+        }
+    }
+    if (clusters.size() != static_cast<size_t>(count)) return {};
+    std::sort(clusters.begin(), clusters.end());
+    return clusters;
+}
@@ -0,0 +1,58 @@
+#ifndef ZOS_SP_FREEEXTENTINDEX_H
+#define ZOS_SP_FREEEXTENTINDEX_H
+
+#include "FreeClusterBitmap.h"
+#include <map>
+#include <set>
+#include <vector>
+
+/**
+ * Free space as maximal runs of consecutive free clusters, indexed both by
+ * start cluster (for merging/splitting on label changes) and by length (for
+ * best-fit lookups).
+ */
+class FreeExtentIndex {
+private:
+    std::map<int32_t, int32_t> mByStart; // start -> length
+    std::set<std::pair<int32_t, int32_t>> mByLength; // (length, start)
+
+    void insert(int32_t start, int32_t length);
+
+    void erase(std::map<int32_t, int32_t>::iterator it);
+
+public:
+    void build(const FreeClusterBitmap &bitmap, int32_t clusterCount);
+
+    void markFree(int32_t cluster) { markFree(cluster, 1); }
+
+    void markUsed(int32_t cluster) { markUsed(cluster, 1); }
+
+    /**
+     * Run of `length` used clusters becomes free, merged with its neighbours.
+     */
+    void markFree(int32_t start, int32_t length);
+
+    /**
+     * Run of `length` free clusters becomes used, the run must lie within
+     * one free extent.
+     */
+    void markUsed(int32_t start, int32_t length);
+
+    /**
+     * Start of the shortest free run with at least `count` clusters, -1 if
+     * there is none. Ties are resolved by the lowest start cluster.
+     */
+    int32_t bestFit(int32_t count) const;
+
+    /**
+     * Free clusters collected from the longest runs first, so the result
+     * consists of as few runs as possible. Returned in ascending order, empty
+     * if there is not enough free clusters.
+     */
+    std::vector<int> largestFirst(int32_t count) const;
+
+    size_t extentCount() const { return mByStart.size(); }
+};
+
+
+#endif //ZOS_SP_FREEEXTENTINDEX_H
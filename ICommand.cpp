@@ -1,18 +1,40 @@
 #include "ICommand.h"
 
 ICommand::ICommand(const std::vector<std::string> &options) {
-    mOptCount = static_cast<int>(options.size());
+    std::vector<std::string> arguments{};
+    for (auto &it: options) {
+        if (it.length() > 1 && it[0] == '-') {
+            mSwitches.insert(it);
+        } else {
+            arguments.push_back(it);
+        }
+    }
+
+    mOptCount = static_cast<int>(arguments.size());
     if (!mOptCount) return;
-    mOpt1 = options[0];
-    if (mOptCount == 2) mOpt2 = options[1];
+    mOpt1 = arguments[0];
+    if (mOptCount == 2) mOpt2 = arguments[1];
 }
 
 void ICommand::process() {
+    for (auto &it: mSwitches) {
+        if (!isSwitchSupported(it))
+            throw InvalidOptionException(UNKNOWN_SWITCH_ERROR + " " + it);
+    }
+    FileSystem::CommandLock lock(*mFS, !isReadOnly());
     if (!this->validateArguments()) {
         throw InvalidOptionException("invalid option(s)");
     }
-    if (this->run()) {
-        std::cout << "OK" << std::endl;
+    bool ok;
+    try {
+        ok = this->run();
+    } catch (...) {
+        if (!isReadOnly()) mFS->abortTransaction();
+        throw;
+    }
+    if (!isReadOnly()) mFS->endTransaction();
+    if (ok) {
+        out() << "OK" << std::endl;
     }
 }
 
@@ -2,6 +2,8 @@
 #define ZOS_SP_ICOMMAND_H
 
 #include "FileSystem.h"
+#include <memory>
+#include <set>
 #include <utility>
 #include <vector>
 #include <iostream>
@@ -14,11 +16,26 @@ private:
 
     virtual bool run() = 0;
 
+    virtual bool isSwitchSupported(const std::string &name) const { return false; }
+
+    /**
+     * Read-only commands share the fs lock and run in parallel with each other.
+     */
+    virtual bool isReadOnly() const { return false; }
+
 protected:
     std::shared_ptr<FileSystem> mFS;
     int mOptCount;
     std::string mOpt1;
     std::string mOpt2;
+    std::set<std::string> mSwitches; // options starting with '-', e.g. --reflink
+
+    bool hasSwitch(const std::string &name) const { return mSwitches.count(name) > 0; }
+
+    /**
+     * Output of the session running the command.
+     */
+    std::ostream &out() const { return mFS->getSession().out(); }
 
 public:
     explicit ICommand(const std::vector<std::string> &options);
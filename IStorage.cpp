@@ -0,0 +1,16 @@
+#include "IStorage.h"
+#include "StreamStorage.h"
+#include "MappedStorage.h"
+#include "PositionalStorage.h"
+
+std::unique_ptr<IStorage> openStorage(EStorageType type, const std::string &fileName, bool truncate) {
+    switch (type) {
+        case EStorageType::MMAP:
+            return std::unique_ptr<IStorage>(new MappedStorage(fileName, truncate));
+        case EStorageType::PREAD:
+            return std::unique_ptr<IStorage>(new PositionalStorage(fileName, truncate));
+        case EStorageType::STREAM:
+        default:
+            return std::unique_ptr<IStorage>(new StreamStorage(fileName, truncate));
+    }
+}
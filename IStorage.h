@@ -0,0 +1,67 @@
+#ifndef ZOS_SP_ISTORAGE_H
+#define ZOS_SP_ISTORAGE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <string>
+
+enum class EStorageType {
+    STREAM,
+    MMAP,
+    PREAD,
+};
+
+/**
+ * Backing store of the file system image.
+ *
+ * Implementations provide positional access (readAt/writeAt), the cursor
+ * based API (seek/read/write) mimics std::fstream so the (de)serialization
+ * of fs structures stays sequential.
+ */
+class IStorage {
+protected:
+    int64_t mCursor = 0;
+
+public:
+    virtual ~IStorage() = default;
+
+    virtual void readAt(int64_t pos, char *data, size_t size) = 0;
+
+    virtual void writeAt(int64_t pos, const char *data, size_t size) = 0;
+
+    /**
+     * Sets the image size, new bytes are zeroed.
+     */
+    virtual void resize(int64_t size) = 0;
+
+    virtual int64_t size() const = 0;
+
+    virtual void flush() = 0;
+
+    /**
+     * Flushes and waits until the data are durable.
+     */
+    virtual void sync() = 0;
+
+    void seek(int64_t pos) { mCursor = pos; }
+
+    int64_t tell() const { return mCursor; }
+
+    void read(char *data, size_t size) {
+        readAt(mCursor, data, size);
+        mCursor += static_cast<int64_t>(size);
+    }
+
+    void write(const char *data, size_t size) {
+        writeAt(mCursor, data, size);
+        mCursor += static_cast<int64_t>(size);
+    }
+};
+
+/**
+ * @param truncate Discards previous image contents.
+ */
+std::unique_ptr<IStorage> openStorage(EStorageType type, const std::string &fileName, bool truncate);
+
+#endif //ZOS_SP_ISTORAGE_H
@@ -0,0 +1,216 @@
+#include "Journal.h"
+#include "definitions.h"
+#include "utils/hash-utils.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+
+Journal::Journal(IStorage &storage, int64_t startAddress, int64_t size) :
+        mStorage(storage), mStartAddress(startAddress), mSize(size) {}
+
+void Journal::addRegion(int64_t start, int64_t end, int64_t blockSize) {
+    mRegions.push_back({start, end, blockSize});
+}
+
+const Journal::Region &Journal::getRegion(int64_t pos) const {
+    for (auto &it: mRegions) {
+        if (pos >= it.mStart && pos < it.mEnd) return it;
+    }
+    throw std::runtime_error(CORRUPTED_FS_ERROR);
+}
+
+std::vector<char> &Journal::getBlock(const Region &region, int64_t address) {
+    auto it = mBlocks.find(address);
+    if (it != mBlocks.end()) return it->second;
+
+    std::vector<char> block(std::min(region.mBlockSize, region.mEnd - address));
+    mStorage.readAt(address, block.data(), block.size());
+    mPendingSize += static_cast<int64_t>(block.size());
+    return mBlocks.emplace(address, std::move(block)).first->second;
+}
+
+/**
+ * Record: header, (address, size) of each block, block images.
+ */
+int64_t Journal::getRecordSize() const {
+    return sizeof(RecordHeader) + mBlocks.size() * 2 * sizeof(int64_t) + mPendingSize;
+}
+
+void Journal::readAt(int64_t pos, char *data, size_t size) {
+    auto end = pos + static_cast<int64_t>(size);
+    mStorage.readAt(pos, data, size);
+
+    // pending block images overlapping the range replace stored data
+    auto it = mBlocks.lower_bound(pos);
+    if (it != mBlocks.begin() && std::prev(it)->first + static_cast<int64_t>(std::prev(it)->second.size()) > pos)
+        it--;
+    for (; it != mBlocks.end() && it->first < end; it++) {
+        auto from = std::max(pos, it->first);
+        auto to = std::min(end, it->first + static_cast<int64_t>(it->second.size()));
+        memcpy(data + (from - pos), it->second.data() + (from - it->first), to - from);
+    }
+}
+
+void Journal::writeAt(int64_t pos, const char *data, size_t size) {
+    if (!isBuffering()) {
+        mStorage.writeAt(pos, data, size);
+        return;
+    }
+
+    auto end = pos + static_cast<int64_t>(size);
+    while (pos < end) {
+        auto &region = getRegion(pos);
+        auto address = pos - (pos - region.mStart) % region.mBlockSize;
+        if (!mUndoBlocks.count(address)) {
+            auto it = mBlocks.find(address);
+            mUndoBlocks[address] = it != mBlocks.end() ? it->second : std::vector<char>{};
+        }
+        auto &block = getBlock(region, address);
+        auto to = std::min(end, address + static_cast<int64_t>(block.size()));
+        memcpy(block.data() + (pos - address), data, to - pos);
+        data += to - pos;
+        pos = to;
+    }
+}
+
+void Journal::endTransaction() {
+    if (!mBlocks.empty()) mTransactions++;
+    mUndoBlocks.clear();
+}
+
+bool Journal::abortTransaction() {
+    for (auto &it: mUndoBlocks) {
+        auto block = mBlocks.find(it.first);
+        if (it.second.empty()) {
+            mPendingSize -= static_cast<int64_t>(block->second.size());
+            mBlocks.erase(block);
+        } else {
+            block->second = std::move(it.second);
+        }
+    }
+    bool changed = !mUndoBlocks.empty();
+    mUndoBlocks.clear();
+    return changed;
+}
+
+uint64_t Journal::checksum(const RecordHeader &header, const std::vector<char> &body) {
+    auto hash = hashBytes(reinterpret_cast<const char *>(&header), offsetof(RecordHeader, mChecksum));
+    return hashBytes(body.data(), body.size(), hash);
+}
+
+/**
+ * Writes pending blocks home, in address order.
+ */
+void Journal::checkpoint() {
+    for (auto it = mBlocks.begin(); it != mBlocks.end();) {
+        // merge neighbouring blocks into one write
+        auto last = std::next(it);
+        std::vector<char> run(it->second);
+        while (last != mBlocks.end() && last->first == it->first + static_cast<int64_t>(run.size())) {
+            run.insert(run.end(), last->second.begin(), last->second.end());
+            last++;
+        }
+        mStorage.writeAt(it->first, run.data(), run.size());
+        it = last;
+    }
+}
+
+void Journal::commit() {
+    if (mBlocks.empty()) {
+        mTransactions = 0;
+        return;
+    }
+
+    // transaction bigger than the journal can't be made atomic, it is only written in order
+    if (getRecordSize() > mSize) {
+        mStorage.sync();
+        checkpoint();
+        mStorage.sync();
+        discard();
+        return;
+    }
+
+    std::vector<char> body(getRecordSize() - sizeof(RecordHeader));
+    auto extents = reinterpret_cast<int64_t *>(body.data());
+    auto blocks = body.data() + mBlocks.size() * 2 * sizeof(int64_t);
+    for (auto &it: mBlocks) {
+        int64_t extent[2] = {it.first, static_cast<int64_t>(it.second.size())};
+        memcpy(extents, extent, sizeof(extent));
+        extents += 2;
+        memcpy(blocks, it.second.data(), it.second.size());
+        blocks += it.second.size();
+    }
+
+    RecordHeader header{MAGIC, static_cast<uint32_t>(mBlocks.size()), ++mSequence, body.size(), 0};
+    header.mChecksum = checksum(header, body);
+
+    // file data written by the transactions are synced along with the record
+    mStorage.writeAt(mStartAddress + sizeof(header), body.data(), body.size());
+    mStorage.writeAt(mStartAddress, reinterpret_cast<const char *>(&header), sizeof(header));
+    mStorage.sync();
+
+    checkpoint();
+    mStorage.sync();
+
+    RecordHeader cleared{};
+    mStorage.writeAt(mStartAddress, reinterpret_cast<const char *>(&cleared), sizeof(cleared));
+    discard();
+}
+
+void Journal::commitEnded() {
+    std::map<int64_t, std::vector<char>> running{};
+    for (auto &it: mUndoBlocks) {
+        running.emplace(it.first, mBlocks.at(it.first));
+    }
+    abortTransaction();
+    commit();
+
+    // running transaction goes on from the committed state
+    for (auto &it: running) {
+        mPendingSize += static_cast<int64_t>(it.second.size());
+        mUndoBlocks.emplace(it.first, std::vector<char>{});
+        mBlocks.emplace(it.first, std::move(it.second));
+    }
+}
+
+void Journal::discard() {
+    mBlocks.clear();
+    mUndoBlocks.clear();
+    mPendingSize = 0;
+    mTransactions = 0;
+}
+
+bool Journal::recover() {
+    if (!isEnabled()) return false;
+
+    RecordHeader header{};
+    mStorage.readAt(mStartAddress, reinterpret_cast<char *>(&header), sizeof(header));
+    mSequence = header.mSequence;
+    if (header.mMagic != MAGIC || !header.mBlockCount
+        || header.mBodySize > static_cast<uint64_t>(mSize) - sizeof(header)
+        || header.mBlockCount * 2 * sizeof(int64_t) > header.mBodySize)
+        return false;
+
+    std::vector<char> body(header.mBodySize);
+    mStorage.readAt(mStartAddress + sizeof(header), body.data(), body.size());
+    if (checksum(header, body) != header.mChecksum) return false; // torn record, never committed
+
+    auto blocks = body.data() + header.mBlockCount * 2 * sizeof(int64_t);
+    auto blocksEnd = body.data() + body.size();
+    for (uint32_t i = 0; i < header.mBlockCount; i++) {
+        int64_t extent[2];
+        memcpy(extent, body.data() + i * sizeof(extent), sizeof(extent));
+        if (extent[1] < 0 || extent[1] > blocksEnd - blocks)
+            throw std::runtime_error(CORRUPTED_FS_ERROR);
+        mStorage.writeAt(extent[0], blocks, extent[1]);
+        blocks += extent[1];
+    }
+    mStorage.sync();
+
+    RecordHeader cleared{};
+    mStorage.writeAt(mStartAddress, reinterpret_cast<const char *>(&cleared), sizeof(cleared));
+    mStorage.sync();
+    return true;
+}
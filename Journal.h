@@ -0,0 +1,131 @@
+#ifndef ZOS_SP_JOURNAL_H
+#define ZOS_SP_JOURNAL_H
+
+#include "IStorage.h"
+#include <map>
+#include <vector>
+
+/**
+ * Metadata write-ahead log. FAT and directory writes go through this storage
+ * view, they are kept as block images in memory (and served to reads) until
+ * commit, which
+ *  1. writes all pending blocks as one record into the journal region and syncs,
+ *  2. writes the blocks to their home locations in address order and syncs,
+ *  3. clears the record.
+ * One commit holds several transactions (group commit). After a crash,
+ * recover() replays a complete record, a torn one fails its checksum and
+ * is ignored since nothing was checkpointed yet.
+ *
+ * Blocks never cross region boundaries (FAT pages, data clusters), so a
+ * block image can't overwrite unjournaled file data next to it. Images
+ * without journal region (version 1) write metadata straight through.
+ */
+class Journal : public IStorage {
+private:
+    static const uint32_t MAGIC = 0x4c4e524a; // "JRNL"
+
+    struct RecordHeader {
+        uint32_t mMagic;
+        uint32_t mBlockCount;
+        uint64_t mSequence;
+        uint64_t mBodySize;
+        uint64_t mChecksum;
+    };
+
+    struct Region {
+        int64_t mStart;
+        int64_t mEnd;
+        int64_t mBlockSize;
+    };
+
+    IStorage &mStorage;
+    const int64_t mStartAddress;
+    const int64_t mSize;
+    uint64_t mSequence = 0;
+    std::vector<Region> mRegions;
+    std::map<int64_t, std::vector<char>> mBlocks; // block address -> pending block image
+    std::map<int64_t, std::vector<char>> mUndoBlocks; // images before the running transaction, empty = not pending
+    int64_t mPendingSize = 0;
+    int mTransactions = 0; // finished transactions waiting for commit
+    bool mBatch = false;
+
+    const Region &getRegion(int64_t pos) const;
+
+    std::vector<char> &getBlock(const Region &region, int64_t address);
+
+    static uint64_t checksum(const RecordHeader &header, const std::vector<char> &body);
+
+    int64_t getRecordSize() const;
+
+    void checkpoint();
+
+public:
+    Journal(IStorage &storage, int64_t startAddress, int64_t size);
+
+    /**
+     * Metadata region [start, end) journaled in blocks of given size.
+     */
+    void addRegion(int64_t start, int64_t end, int64_t blockSize);
+
+    void readAt(int64_t pos, char *data, size_t size) override;
+
+    void writeAt(int64_t pos, const char *data, size_t size) override;
+
+    void resize(int64_t size) override { mStorage.resize(size); }
+
+    int64_t size() const override { return mStorage.size(); }
+
+    void flush() override { mStorage.flush(); }
+
+    void sync() override { mStorage.sync(); }
+
+    bool isEnabled() const { return mSize > 0; }
+
+    /**
+     * Batch keeps metadata writes in memory until commit even without
+     * journal region, so they can be discarded.
+     */
+    void setBatch(bool batch) { mBatch = batch; }
+
+    /**
+     * @return Metadata writes are kept in memory until commit.
+     */
+    bool isBuffering() const { return isEnabled() || mBatch; }
+
+    void endTransaction();
+
+    /**
+     * Restores pending blocks as of the last endTransaction.
+     * @return The running transaction had written anything.
+     */
+    bool abortTransaction();
+
+    /**
+     * Commits transactions finished by endTransaction, blocks written by the
+     * running one stay pending and can still be aborted.
+     */
+    void commitEnded();
+
+    int pendingTransactions() const { return mTransactions; }
+
+    /**
+     * @return Pending blocks take over half of the journal, commit soon.
+     */
+    bool isFull() const { return getRecordSize() * 2 > mSize; }
+
+    void commit();
+
+    /**
+     * Drops pending blocks, stored metadata stay as of the last commit.
+     */
+    void discard();
+
+    /**
+     * Replays committed record left by interrupted commit.
+     * @return Record was replayed.
+     */
+    bool recover();
+};
+
+
+#endif //ZOS_SP_JOURNAL_H
@@ -0,0 +1,82 @@
+#include "MappedStorage.h"
+#include "definitions.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedStorage::MappedStorage(const std::string &fileName, bool truncate) {
+    int flags = O_RDWR | O_CREAT;
+    if (truncate) flags |= O_TRUNC;
+    mFd = open(fileName.c_str(), flags, 0644);
+    if (mFd < 0)
+        throw std::runtime_error(FS_OPEN_ERROR);
+
+    struct stat st{};
+    if (fstat(mFd, &st) != 0) {
+        close(mFd);
+        throw std::runtime_error(FS_OPEN_ERROR);
+    }
+    mSize = st.st_size;
+    map();
+}
+
+MappedStorage::~MappedStorage() {
+    unmap();
+    if (mFd >= 0) close(mFd);
+}
+
+void MappedStorage::map() {
+    if (!mSize) return;
+    void *addr = mmap(nullptr, static_cast<size_t>(mSize), PROT_READ | PROT_WRITE, MAP_SHARED, mFd, 0);
+    if (addr == MAP_FAILED) {
+        mData = nullptr;
+        throw std::runtime_error(FS_MAP_ERROR);
+    }
+    mData = static_cast<char *>(addr);
+}
+
+void MappedStorage::unmap() {
+    if (mData) munmap(mData, static_cast<size_t>(mSize));
+    mData = nullptr;
+}
+
+void MappedStorage::readAt(int64_t pos, char *data, size_t size) {
+    if (pos < 0 || pos >= mSize) {
+        std::memset(data, 0, size);
+        return;
+    }
+    auto available = static_cast<size_t>(mSize - pos);
+    auto count = std::min(size, available);
+    std::memcpy(data, mData + pos, count);
+    if (count < size) std::memset(data + count, 0, size - count);
+}
+
+void MappedStorage::writeAt(int64_t pos, const char *data, size_t size) {
+    auto end = pos + static_cast<int64_t>(size);
+    if (end > mSize) resize(end);
+    std::memcpy(mData + pos, data, size);
+}
+
+void MappedStorage::resize(int64_t size) {
+    unmap();
+    if (ftruncate(mFd, size) != 0)
+        throw std::runtime_error(FS_RESIZE_ERROR);
+    mSize = size;
+    map();
+}
+
+void MappedStorage::flush() {
+    if (mData) msync(mData, static_cast<size_t>(mSize), MS_ASYNC);
+}
+
+void MappedStorage::sync() {
+    if (mData && msync(mData, static_cast<size_t>(mSize), MS_SYNC) != 0)
+        throw std::runtime_error(FS_SYNC_ERROR);
+    if (fsync(mFd) != 0)
+        throw std::runtime_error(FS_SYNC_ERROR);
+}
@@ -0,0 +1,43 @@
+#ifndef ZOS_SP_MAPPEDSTORAGE_H
+#define ZOS_SP_MAPPEDSTORAGE_H
+
+#include "IStorage.h"
+
+/**
+ * Maps the whole image into memory (MAP_SHARED), reads and writes are plain
+ * memory copies without syscalls. Writes past the end grow the image and
+ * remap it.
+ */
+class MappedStorage : public IStorage {
+    int mFd = -1;
+    char *mData = nullptr;
+    int64_t mSize = 0;
+
+    void map();
+
+    void unmap();
+
+public:
+    MappedStorage(const std::string &fileName, bool truncate);
+
+    ~MappedStorage() override;
+
+    MappedStorage(const MappedStorage &) = delete;
+
+    MappedStorage &operator=(const MappedStorage &) = delete;
+
+    void readAt(int64_t pos, char *data, size_t size) override;
+
+    void writeAt(int64_t pos, const char *data, size_t size) override;
+
+    void resize(int64_t size) override;
+
+    int64_t size() const override { return mSize; }
+
+    void flush() override;
+
+    void sync() override;
+};
+
+
+#endif //ZOS_SP_MAPPEDSTORAGE_H
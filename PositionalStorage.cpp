@@ -0,0 +1,68 @@
+#include "PositionalStorage.h"
+#include "definitions.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+PositionalStorage::PositionalStorage(const std::string &fileName, bool truncate) {
+    int flags = O_RDWR | O_CREAT;
+    if (truncate) flags |= O_TRUNC;
+    mFd = open(fileName.c_str(), flags, 0644);
+    if (mFd < 0)
+        throw std::runtime_error(FS_OPEN_ERROR);
+
+    struct stat st{};
+    if (fstat(mFd, &st) != 0) {
+        close(mFd);
+        throw std::runtime_error(FS_OPEN_ERROR);
+    }
+    mSize = st.st_size;
+}
+
+PositionalStorage::~PositionalStorage() {
+    if (mFd >= 0) close(mFd);
+}
+
+/**
+ * Bytes past the end of the image read as zeros.
+ */
+void PositionalStorage::readAt(int64_t pos, char *data, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        auto count = pread(mFd, data + done, size - done, pos + static_cast<int64_t>(done));
+        if (count < 0 && errno == EINTR) continue;
+        if (count < 0)
+            throw std::runtime_error(FS_READ_ERROR);
+        if (count == 0) break;
+        done += static_cast<size_t>(count);
+    }
+    if (done < size) std::memset(data + done, 0, size - done);
+}
+
+void PositionalStorage::writeAt(int64_t pos, const char *data, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        auto count = pwrite(mFd, data + done, size - done, pos + static_cast<int64_t>(done));
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0)
+            throw std::runtime_error(FS_WRITE_ERROR);
+        done += static_cast<size_t>(count);
+    }
+    auto end = pos + static_cast<int64_t>(size);
+    if (end > mSize) mSize = end;
+}
+
+void PositionalStorage::resize(int64_t size) {
+    if (ftruncate(mFd, size) != 0)
+        throw std::runtime_error(FS_RESIZE_ERROR);
+    mSize = size;
+}
+
+void PositionalStorage::sync() {
+    if (fsync(mFd) != 0)
+        throw std::runtime_error(FS_SYNC_ERROR);
+}
@@ -0,0 +1,38 @@
+#ifndef ZOS_SP_POSITIONALSTORAGE_H
+#define ZOS_SP_POSITIONALSTORAGE_H
+
+#include "IStorage.h"
+#include <atomic>
+
+/**
+ * pread/pwrite backed storage. There is no shared file offset, so readAt
+ * may be called from several threads at once.
+ */
+class PositionalStorage : public IStorage {
+    int mFd = -1;
+    std::atomic<int64_t> mSize{0};
+
+public:
+    PositionalStorage(const std::string &fileName, bool truncate);
+
+    ~PositionalStorage() override;
+
+    PositionalStorage(const PositionalStorage &) = delete;
+
+    PositionalStorage &operator=(const PositionalStorage &) = delete;
+
+    void readAt(int64_t pos, char *data, size_t size) override;
+
+    void writeAt(int64_t pos, const char *data, size_t size) override;
+
+    void resize(int64_t size) override;
+
+    int64_t size() const override { return mSize; }
+
+    void flush() override {}
+
+    void sync() override;
+};
+
+
+#endif //ZOS_SP_POSITIONALSTORAGE_H
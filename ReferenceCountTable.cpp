@@ -0,0 +1,29 @@
+#include "ReferenceCountTable.h"
+
+void ReferenceCountTable::build(const std::vector<int> &sharedChains) {
+    mCounts.clear();
+    for (auto &it: sharedChains) mCounts[it]++;
+    mBuilt = true;
+}
+
+int ReferenceCountTable::count(int cluster) const {
+    auto it = mCounts.find(cluster);
+    return it == mCounts.end() ? 1 : it->second;
+}
+
+void ReferenceCountTable::acquire(int cluster) {
+    mCounts[cluster] = count(cluster) + 1;
+}
+
+int ReferenceCountTable::release(int cluster) {
+    auto it = mCounts.find(cluster);
+    if (it == mCounts.end()) return 0;
+    if (--it->second > 0) return it->second;
+    mCounts.erase(it);
+    return 0;
+}
+
+void ReferenceCountTable::clear() {
+    mCounts.clear();
+    mBuilt = false;
+}
@@ -0,0 +1,46 @@
+#ifndef ZOS_SP_REFERENCECOUNTTABLE_H
+#define ZOS_SP_REFERENCECOUNTTABLE_H
+
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Reference counts of shared (reflinked) cluster chains keyed by the first
+ * cluster of the chain. A FAT cluster has a single successor, so files can
+ * only share whole chains and counting chain heads is enough. Chains which
+ * aren't in the table are referenced by exactly one directory entry.
+ *
+ * Counts aren't stored on disk, the table is built lazily from directory
+ * entries flagged as shared the first time it's needed after mount.
+ */
+class ReferenceCountTable {
+private:
+    std::unordered_map<int, int> mCounts;
+    bool mBuilt = false;
+
+public:
+    /**
+     * @param sharedChains First cluster of every shared directory entry.
+     */
+    void build(const std::vector<int> &sharedChains);
+
+    bool isBuilt() const { return mBuilt; }
+
+    int count(int cluster) const;
+
+    /**
+     * Adds a reference to the chain.
+     */
+    void acquire(int cluster);
+
+    /**
+     * Drops a reference to the chain.
+     * @return Remaining reference count, chain can be freed at 0.
+     */
+    int release(int cluster);
+
+    void clear();
+};
+
+
+#endif //ZOS_SP_REFERENCECOUNTTABLE_H
@@ -0,0 +1,22 @@
+#ifndef ZOS_SP_SESSION_H
+#define ZOS_SP_SESSION_H
+
+#include "DirectoryEntry.h"
+#include <iostream>
+#include <string>
+
+/**
+ * Client of a mounted fs with its own working directory and command output.
+ * The console is one session, every daemon connection is another.
+ */
+class Session {
+public:
+    DirectoryEntry mWorkingDirectory;
+    std::string mWorkingDirectoryPath{"/"};
+    std::ostream *mOut = &std::cout;
+
+    std::ostream &out() { return *mOut; }
+};
+
+
+#endif //ZOS_SP_SESSION_H
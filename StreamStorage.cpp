@@ -0,0 +1,53 @@
+#include "StreamStorage.h"
+#include "definitions.h"
+
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+StreamStorage::StreamStorage(const std::string &fileName, bool truncate) : mFileName(fileName) {
+    auto mode = std::ios_base::in | std::ios_base::out | std::ios_base::binary;
+    mode |= truncate ? std::ios_base::trunc : std::ios_base::ate;
+    mStream = std::fstream(mFileName, mode);
+    if (!mStream.is_open())
+        throw std::runtime_error(FS_OPEN_ERROR);
+}
+
+void StreamStorage::readAt(int64_t pos, char *data, size_t size) {
+    mStream.clear();
+    mStream.seekg(pos);
+    mStream.read(data, static_cast<std::streamsize>(size));
+}
+
+void StreamStorage::writeAt(int64_t pos, const char *data, size_t size) {
+    mStream.clear();
+    mStream.seekp(pos);
+    mStream.write(data, static_cast<std::streamsize>(size));
+}
+
+void StreamStorage::resize(int64_t size) {
+    mStream.flush();
+    if (truncate(mFileName.c_str(), size) != 0)
+        throw std::runtime_error(FS_RESIZE_ERROR);
+}
+
+int64_t StreamStorage::size() const {
+    struct stat st{};
+    if (stat(mFileName.c_str(), &st) != 0) return 0;
+    return st.st_size;
+}
+
+void StreamStorage::flush() {
+    mStream.flush();
+}
+
+void StreamStorage::sync() {
+    mStream.flush();
+    int fd = open(mFileName.c_str(), O_RDONLY);
+    if (fd < 0 || fsync(fd) != 0) {
+        if (fd >= 0) close(fd);
+        throw std::runtime_error(FS_SYNC_ERROR);
+    }
+    close(fd);
+}
@@ -0,0 +1,31 @@
+#ifndef ZOS_SP_STREAMSTORAGE_H
+#define ZOS_SP_STREAMSTORAGE_H
+
+#include "IStorage.h"
+#include <fstream>
+
+/**
+ * std::fstream backed storage, every access is a seek followed by stream I/O.
+ */
+class StreamStorage : public IStorage {
+    std::string mFileName;
+    std::fstream mStream;
+
+public:
+    StreamStorage(const std::string &fileName, bool truncate);
+
+    void readAt(int64_t pos, char *data, size_t size) override;
+
+    void writeAt(int64_t pos, const char *data, size_t size) override;
+
+    void resize(int64_t size) override;
+
+    int64_t size() const override;
+
+    void flush() override;
+
+    void sync() override;
+};
+
+
+#endif //ZOS_SP_STREAMSTORAGE_H
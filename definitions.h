@@ -3,6 +3,7 @@
 
 #include <cstdint>
 #include <string>
+#include <utility>
 #include <vector>
 
 const int32_t FAT_UNUSED = INT32_MAX - 1; // ffff fffe
@@ -18,18 +19,42 @@ const std::vector<std::string> ALLOWED_FORMATS{"MB"};
 
 
 constexpr auto FAT_COUNT = 1;
-constexpr auto CLUSTER_SIZE = 512 * 8;
+constexpr auto DEFAULT_CLUSTER_SIZE = 512 * 8;
+constexpr auto MIN_CLUSTER_SIZE = 1024;
+constexpr auto MAX_CLUSTER_SIZE = 1024 * 1024;
+const std::vector<std::pair<std::string, int>> CLUSTER_SIZE_UNITS{{"KB", 1024}, {"MB", 1024 * 1024}};
+constexpr auto IO_BUFFER_CLUSTERS = 32; // clusters transferred at once when streaming file data
+
+constexpr auto FS_VERSION = 3; // 1 = no journal, 2 = 32-bit sizes and addresses
+constexpr auto JOURNAL_RESERVE_SIZE = 256 * 1024; // minimal journal size on top of the FAT size
+constexpr auto JOURNAL_RESERVE_CLUSTERS = 8; // journal has to fit this many clusters on top of the FAT size
+constexpr auto GROUP_COMMIT_TRANSACTIONS = 128; // transactions per journal commit when grouped
+constexpr auto JOURNAL_BLOCK_SIZE = 4096; // metadata are journaled in blocks of at most this size
 
 constexpr auto ITEM_NAME_LENGTH = 12; // with EOF
 constexpr auto DEFAULT_DIR_SIZE = 2; // '.' and '..' references
 
+enum class EFileOption {
+    FILE,
+    DIRECTORY,
+    UNSPECIFIED,
+};
+
 // Runtime fatal errors
 const std::string FS_OPEN_ERROR{"internal error, couldn't open file system simulation file"};
+const std::string FS_MAP_ERROR{"internal error, couldn't map file system simulation file"};
+const std::string FS_RESIZE_ERROR{"internal error, couldn't resize file system simulation file"};
+const std::string FS_SYNC_ERROR{"internal error, couldn't sync file system simulation file"};
+const std::string FS_READ_ERROR{"internal error, couldn't read file system simulation file"};
+const std::string FS_WRITE_ERROR{"internal error, couldn't write file system simulation file"};
 const std::string DE_MISSING_REFERENCES_ERROR{"internal error, directory missing references"};
-const std::string DE_LIMIT_REACHED_ERROR{"internal error, directory file limit reached"};
 const std::string DE_ITEM_NAME_LENGTH_ERROR{"internal error, received invalid (too long) entry name"};
 const std::string CORRUPTED_FS_ERROR{"internal error, file system is corrupted"};
 const std::string FILE_READ_ERROR{"internal error, couldn't readVFS file contents"};
+const std::string FILE_WRITE_ERROR{"internal error, couldn't write file contents"};
+const std::string FILE_SIZE_ERROR{"internal error, file size not supported by file system version"};
+const std::string DAEMON_SOCKET_ERROR{"internal error, couldn't open daemon socket"};
+const std::string DAEMON_EVENT_ERROR{"internal error, daemon event loop failed"};
 
 
 // Runtime recoverable errors (custom)
@@ -39,6 +64,14 @@ const std::string INVALID_DIR_PATH_ERROR{"invalid directory path"};
 const std::string INVALID_FILE_NAME_ERROR{"invalid file name"};
 const std::string DELETE_DIR_REFERENCE_ERROR{"cannot delete directory reference"};
 const std::string FILE_NAME_TOO_LONG_ERROR{"filename too long"};
+const std::string UNKNOWN_COMMAND_ERROR{"Unknown command"};
+const std::string UNKNOWN_SWITCH_ERROR{"unknown switch"};
+const std::string BATCH_ROLLBACK_ERROR{"batch failed, changes rolled back"};
+const std::string BATCH_FORMAT_ERROR{"cannot format in batch"};
+const std::string FILE_TOO_LARGE_ERROR{"file too large for this file system version"};
+const std::string NOT_ENOUGH_SPACE_ERROR{"not enough space"};
+const std::string DIRECTORY_IN_USE_ERROR{"directory is working directory of another session"};
+const std::string CONTAINS_WORKING_DIRECTORY_ERROR{"directory contains the working directory"};
 
 
 // Runtime recoverable errors (from specification)
@@ -1,4 +1,5 @@
 #include "Commands.h"
+#include "Daemon.h"
 #include "utils/input-parser.h"
 
 //#include <iostream>
@@ -24,17 +25,44 @@ void startConsole(const std::shared_ptr<FileSystem> &pFS) {
 }
 
 int main(int argc, char **argv) {
-    if (argc != 2) {
+    auto storageType = EStorageType::STREAM;
+    bool deduplicate = false;
+    std::string socketPath;
+    bool validArguments = argc >= 2;
+    for (int i = 2; i < argc; i++) {
+        std::string option{argv[i]};
+        if (option == "--mmap") {
+            storageType = EStorageType::MMAP;
+        } else if (option == "--pread") {
+            storageType = EStorageType::PREAD;
+        } else if (option == "--dedup") {
+            deduplicate = true;
+        } else if (option == "--daemon" && i + 1 < argc) {
+            socketPath = argv[++i];
+        } else {
+            validArguments = false;
+        }
+    }
+    if (!validArguments) {
         std::cerr << "Invalid argument.\n"
-                     "Usage: <executable> fs_file_name" << std::endl;
+                     "Usage: <executable> fs_file_name [--mmap | --pread] [--dedup] [--daemon socket_path]" << std::endl;
+        return 1;
     }
 
     std::string fsFileName{argv[1]};
+    // workers read the image concurrently, stream storage has a single shared cursor
+    if (!socketPath.empty() && storageType == EStorageType::STREAM) storageType = EStorageType::PREAD;
 
-    auto pFS = std::make_shared<FileSystem>(fsFileName);
+    auto pFS = std::make_shared<FileSystem>(fsFileName, storageType, deduplicate);
 
     std::cout << *pFS << std::endl;
 
+    if (!socketPath.empty()) {
+        auto workerCount = std::max(2u, std::thread::hardware_concurrency());
+        Daemon(pFS, socketPath, static_cast<int>(workerCount)).run();
+        return 0;
+    }
+
     startConsole(pFS);
     return 0;
 }
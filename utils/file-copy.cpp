@@ -0,0 +1,74 @@
+#include "file-copy.h"
+#include "../definitions.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <stdexcept>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+constexpr size_t COPY_BUFFER_SIZE = 1 << 20;
+
+/**
+ * Fallback copy through a user-space buffer.
+ */
+void copyWithBuffer(int inFd, int64_t inOffset, int outFd, int64_t outOffset, size_t size) {
+    std::vector<char> buffer(std::min(size, COPY_BUFFER_SIZE));
+    while (size > 0) {
+        auto count = pread(inFd, buffer.data(), std::min(size, buffer.size()), inOffset);
+        if (count <= 0)
+            throw std::runtime_error(FILE_READ_ERROR);
+        for (ssize_t written = 0; written < count;) {
+            auto res = pwrite(outFd, buffer.data() + written, count - written, outOffset + written);
+            if (res < 0)
+                throw std::runtime_error(FILE_WRITE_ERROR);
+            written += res;
+        }
+        inOffset += count;
+        outOffset += count;
+        size -= count;
+    }
+}
+
+bool isUnsupportedCopy(int error) {
+    return error == ENOSYS || error == EXDEV || error == EINVAL || error == EOPNOTSUPP;
+}
+
+/**
+ * Copies range between two files without passing data through user space
+ * where the kernel allows it: copy_file_range, then sendfile, then plain
+ * pread/pwrite.
+ */
+void copyFileRange(int inFd, int64_t inOffset, int outFd, int64_t outOffset, size_t size) {
+#ifdef __linux__
+    loff_t in = inOffset, out = outOffset;
+    while (size > 0) {
+        auto count = copy_file_range(inFd, &in, outFd, &out, size, 0);
+        if (count < 0 && isUnsupportedCopy(errno)) break;
+        if (count <= 0)
+            throw std::runtime_error(FILE_WRITE_ERROR);
+        size -= count;
+    }
+
+    if (size > 0 && lseek(outFd, out, SEEK_SET) == out) {
+        off_t sendOffset = in;
+        while (size > 0) {
+            auto count = sendfile(outFd, inFd, &sendOffset, size);
+            if (count < 0 && isUnsupportedCopy(errno)) break;
+            if (count <= 0)
+                throw std::runtime_error(FILE_WRITE_ERROR);
+            size -= count;
+            out += count;
+        }
+        in = sendOffset;
+    }
+    inOffset = in;
+    outOffset = out;
+#endif
+    if (size > 0) copyWithBuffer(inFd, inOffset, outFd, outOffset, size);
+}
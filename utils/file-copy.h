@@ -0,0 +1,9 @@
+#ifndef ZOS_SP_FILE_COPY_H
+#define ZOS_SP_FILE_COPY_H
+
+#include <cstddef>
+#include <cstdint>
+
+void copyFileRange(int inFd, int64_t inOffset, int outFd, int64_t outOffset, size_t size);
+
+#endif //ZOS_SP_FILE_COPY_H
@@ -0,0 +1,11 @@
+#include "hash-utils.h"
+
+constexpr uint64_t HASH_PRIME = 0x100000001b3ull;
+
+uint64_t hashBytes(const char *data, size_t size, uint64_t hash) {
+    for (size_t i = 0; i < size; i++) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= HASH_PRIME;
+    }
+    return hash;
+}
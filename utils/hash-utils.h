@@ -0,0 +1,14 @@
+#ifndef ZOS_SP_HASH_UTILS_H
+#define ZOS_SP_HASH_UTILS_H
+
+#include <cstddef>
+#include <cstdint>
+
+constexpr uint64_t HASH_OFFSET_BASIS = 0xcbf29ce484222325ull;
+
+/**
+ * 64-bit FNV-1a, pass previous result as `hash` to hash data in blocks.
+ */
+uint64_t hashBytes(const char *data, size_t size, uint64_t hash = HASH_OFFSET_BASIS);
+
+#endif //ZOS_SP_HASH_UTILS_H
@@ -0,0 +1,146 @@
+#include "lz-codec.h"
+#include "../definitions.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+constexpr size_t MIN_MATCH = 4;
+constexpr size_t MAX_OFFSET = 0xffff;
+constexpr int HASH_BITS = 14;
+constexpr int SKIP_TRIGGER = 6; // step grows after 2^SKIP_TRIGGER misses in a row
+constexpr uint8_t LENGTH_MASK = 0x0f;
+
+uint32_t read32(const uint8_t *data) {
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+uint32_t hashSequence(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/**
+ * Writes remainder of the length which didn't fit into the token nibble.
+ */
+bool writeLength(uint8_t *&out, const uint8_t *end, size_t length) {
+    if (length < LENGTH_MASK) return true;
+    for (length -= LENGTH_MASK; length >= 0xff; length -= 0xff) {
+        if (out == end) return false;
+        *out++ = 0xff;
+    }
+    if (out == end) return false;
+    *out++ = static_cast<uint8_t>(length);
+    return true;
+}
+
+bool readLength(const uint8_t *&in, const uint8_t *end, size_t &length) {
+    if (length < LENGTH_MASK) return true;
+    for (uint8_t byte = 0xff; byte == 0xff; length += byte) {
+        if (in == end) return false;
+        byte = *in++;
+    }
+    return true;
+}
+
+/**
+ * Sequence: token (literal length << 4 | match length - MIN_MATCH), literal
+ * length remainder, literals, 16-bit match offset, match length remainder.
+ * The last sequence has literals only.
+ */
+bool writeSequence(uint8_t *&out, const uint8_t *end, const uint8_t *literals, size_t literalCount,
+                   size_t offset, size_t matchLength) {
+    if (out == end) return false;
+    uint8_t *token = out++;
+    *token = static_cast<uint8_t>(std::min<size_t>(literalCount, LENGTH_MASK) << 4);
+    if (!writeLength(out, end, literalCount) || static_cast<size_t>(end - out) < literalCount) return false;
+    if (literalCount) memcpy(out, literals, literalCount);
+    out += literalCount;
+
+    if (!matchLength) return true;
+    if (end - out < 2) return false;
+    *out++ = static_cast<uint8_t>(offset);
+    *out++ = static_cast<uint8_t>(offset >> 8);
+    *token |= static_cast<uint8_t>(std::min<size_t>(matchLength - MIN_MATCH, LENGTH_MASK));
+    return writeLength(out, end, matchLength - MIN_MATCH);
+}
+
+size_t lzCompressBound(size_t size) {
+    return size + size / 0xff + 16;
+}
+
+size_t lzCompress(const char *src, size_t size, char *dst, size_t capacity) {
+    auto in = reinterpret_cast<const uint8_t *>(src);
+    auto out = reinterpret_cast<uint8_t *>(dst);
+    const uint8_t *end = out + capacity;
+    std::vector<int32_t> table(1 << HASH_BITS, -1);
+
+    size_t anchor = 0, pos = 0, misses = 0;
+    while (pos + MIN_MATCH <= size) {
+        uint32_t sequence = read32(in + pos);
+        auto &slot = table[hashSequence(sequence)];
+        size_t candidate = slot;
+        slot = static_cast<int32_t>(pos);
+
+        if (candidate == static_cast<size_t>(-1) || pos - candidate > MAX_OFFSET || read32(in + candidate) != sequence) {
+            pos += 1 + (misses++ >> SKIP_TRIGGER);
+            continue;
+        }
+
+        size_t matchLength = MIN_MATCH;
+        while (pos + matchLength < size && in[candidate + matchLength] == in[pos + matchLength]) matchLength++;
+
+        if (!writeSequence(out, end, in + anchor, pos - anchor, pos - candidate, matchLength)) return 0;
+        pos += matchLength;
+        anchor = pos;
+        misses = 0;
+    }
+
+    if (!writeSequence(out, end, in + anchor, size - anchor, 0, 0)) return 0;
+    return out - reinterpret_cast<uint8_t *>(dst);
+}
+
+size_t lzDecompress(const char *src, size_t size, char *dst, size_t capacity) {
+    auto in = reinterpret_cast<const uint8_t *>(src);
+    const uint8_t *inEnd = in + size;
+    auto out = reinterpret_cast<uint8_t *>(dst);
+    const uint8_t *outBegin = out, *outEnd = out + capacity;
+
+    while (in < inEnd) {
+        uint8_t token = *in++;
+
+        size_t literalCount = token >> 4;
+        if (!readLength(in, inEnd, literalCount)
+            || static_cast<size_t>(inEnd - in) < literalCount || static_cast<size_t>(outEnd - out) < literalCount)
+            throw std::runtime_error(CORRUPTED_FS_ERROR);
+        memcpy(out, in, literalCount);
+        in += literalCount;
+        out += literalCount;
+
+        if (in == inEnd) break; // last sequence
+
+        if (inEnd - in < 2)
+            throw std::runtime_error(CORRUPTED_FS_ERROR);
+        size_t offset = in[0] | (in[1] << 8);
+        in += 2;
+
+        size_t matchLength = token & LENGTH_MASK;
+        if (!readLength(in, inEnd, matchLength))
+            throw std::runtime_error(CORRUPTED_FS_ERROR);
+        matchLength += MIN_MATCH;
+
+        if (!offset || offset > static_cast<size_t>(out - outBegin) || static_cast<size_t>(outEnd - out) < matchLength)
+            throw std::runtime_error(CORRUPTED_FS_ERROR);
+        const uint8_t *match = out - offset;
+        if (offset >= matchLength) {
+            memcpy(out, match, matchLength);
+            out += matchLength;
+        } else {
+            for (size_t i = 0; i < matchLength; i++) *out++ = *match++; // overlapping copy
+        }
+    }
+    return out - outBegin;
+}
@@ -0,0 +1,26 @@
+#ifndef ZOS_SP_LZ_CODEC_H
+#define ZOS_SP_LZ_CODEC_H
+
+#include <cstddef>
+
+/**
+ * Small LZ77 block codec (LZ4-like sequences of literals and matches with
+ * 16-bit offsets), greedy hash matching, no entropy coding.
+ */
+
+/**
+ * @return Size needed for compressed data of `size` bytes in the worst case.
+ */
+size_t lzCompressBound(size_t size);
+
+/**
+ * @return Compressed size, 0 if compressed data don't fit in `capacity`.
+ */
+size_t lzCompress(const char *src, size_t size, char *dst, size_t capacity);
+
+/**
+ * @return Decompressed size, throws std::runtime_error on malformed input.
+ */
+size_t lzDecompress(const char *src, size_t size, char *dst, size_t capacity);
+
+#endif //ZOS_SP_LZ_CODEC_H
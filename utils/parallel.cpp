@@ -0,0 +1,126 @@
+#include "parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+constexpr unsigned MIN_IO_WORKERS = 4;
+
+void parallelFor(size_t count, unsigned threads, const std::function<void(size_t)> &task) {
+    std::atomic<size_t> next{0};
+    std::atomic<bool> failed{false};
+    std::exception_ptr error;
+    std::mutex errorMutex;
+
+    auto worker = [&]() {
+        for (size_t i; !failed && (i = next++) < count;) {
+            try {
+                task(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(errorMutex);
+                if (!error) error = std::current_exception();
+                failed = true;
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads; i++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (auto &it: pool) {
+        it.join();
+    }
+    if (error) std::rethrow_exception(error);
+}
+
+unsigned getWorkerCount(size_t count) {
+    auto threads = std::max(MIN_IO_WORKERS, std::thread::hardware_concurrency());
+    return static_cast<unsigned>(std::min<size_t>(threads, std::max<size_t>(count, 1)));
+}
+
+static thread_local size_t currentWorker = 0; // index of the worker running the calling thread
+
+TaskPool::TaskPool(unsigned threads) {
+    for (unsigned i = 0; i < std::max(1u, threads); i++) {
+        mWorkers.emplace_back(new Worker{});
+    }
+}
+
+void TaskPool::spawn(Task task) {
+    auto &worker = *mWorkers[currentWorker % mWorkers.size()];
+    mPending++;
+    mQueued++;
+    {
+        std::lock_guard<std::mutex> lock(worker.mMutex);
+        worker.mTasks.push_back(std::move(task));
+    }
+    std::lock_guard<std::mutex> lock(mIdleMutex);
+    mWorkAvailable.notify_one();
+}
+
+/**
+ * Newest task of own deque, otherwise the oldest task of the next worker having any.
+ */
+bool TaskPool::takeTask(size_t worker, Task &task) {
+    for (size_t i = 0; i < mWorkers.size(); i++) {
+        auto &victim = *mWorkers[(worker + i) % mWorkers.size()];
+        std::lock_guard<std::mutex> lock(victim.mMutex);
+        if (victim.mTasks.empty()) continue;
+        if (i == 0) {
+            task = std::move(victim.mTasks.back());
+            victim.mTasks.pop_back();
+        } else {
+            task = std::move(victim.mTasks.front());
+            victim.mTasks.pop_front();
+        }
+        mQueued--;
+        return true;
+    }
+    return false;
+}
+
+void TaskPool::work(size_t worker) {
+    currentWorker = worker;
+    Task task;
+    while (!mFailed) {
+        if (takeTask(worker, task)) {
+            try {
+                task();
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mIdleMutex);
+                if (!mError) mError = std::current_exception();
+                mFailed = true;
+            }
+            task = nullptr;
+            if (--mPending == 0) {
+                std::lock_guard<std::mutex> lock(mIdleMutex);
+                mWorkAvailable.notify_all();
+            }
+            continue;
+        }
+
+        // nothing to steal, wait until some running task spawns more or all are done
+        std::unique_lock<std::mutex> lock(mIdleMutex);
+        mWorkAvailable.wait(lock, [this] { return mQueued > 0 || mPending == 0 || mFailed; });
+        if (mPending == 0) break;
+    }
+    std::lock_guard<std::mutex> lock(mIdleMutex);
+    mWorkAvailable.notify_all();
+}
+
+void TaskPool::run() {
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < mWorkers.size(); i++) {
+        threads.emplace_back(&TaskPool::work, this, i);
+    }
+    work(0);
+    for (auto &it: threads) {
+        it.join();
+    }
+    currentWorker = 0;
+    if (mError) std::rethrow_exception(mError);
+}
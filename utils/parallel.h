@@ -0,0 +1,70 @@
+#ifndef ZOS_SP_PARALLEL_H
+#define ZOS_SP_PARALLEL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/**
+ * Runs task(i) for every i in [0, count) on up to `threads` threads, the
+ * calling one included. After a task throws no new tasks are started and
+ * the first exception is rethrown once all threads finish.
+ */
+void parallelFor(size_t count, unsigned threads, const std::function<void(size_t)> &task);
+
+/**
+ * @return Number of threads worth running for `count` I/O bound tasks, at
+ * least a few even on a single core so the disk always has requests queued.
+ */
+unsigned getWorkerCount(size_t count = SIZE_MAX);
+
+/**
+ * Work-stealing pool for tasks spawning further tasks, e.g. a tree walk.
+ * Every worker keeps its own deque, runs its newest task first and, once it
+ * runs out of work, steals the oldest task of another worker. Error handling
+ * is the same as in parallelFor.
+ */
+class TaskPool {
+public:
+    using Task = std::function<void()>;
+
+private:
+    struct Worker {
+        std::mutex mMutex;
+        std::deque<Task> mTasks;
+    };
+
+    std::vector<std::unique_ptr<Worker>> mWorkers;
+    std::atomic<size_t> mQueued{0}; // tasks waiting in deques
+    std::atomic<size_t> mPending{0}; // spawned tasks not finished yet
+    std::atomic<bool> mFailed{false};
+    std::exception_ptr mError;
+    std::mutex mIdleMutex; // guards mError too
+    std::condition_variable mWorkAvailable;
+
+    bool takeTask(size_t worker, Task &task);
+
+    void work(size_t worker);
+
+public:
+    explicit TaskPool(unsigned threads);
+
+    /**
+     * Queues task, called from a task it goes to the deque of its worker.
+     */
+    void spawn(Task task);
+
+    /**
+     * Runs until all tasks, including those spawned meanwhile, are finished.
+     */
+    void run();
+};
+
+#endif //ZOS_SP_PARALLEL_H
@@ -1,4 +1,5 @@
 #include "string-utils.h"
+#include <algorithm>
 #include <functional>
 #include <vector>
 
@@ -11,5 +11,6 @@ bool isAllocatedDirectoryEntry(const std::string &itemName) {
 }
 
 bool validateFilePath(const std::string &path) {
-    return std::regex_match(path, std::regex(rFilePath));
+    static const std::regex filePath(rFilePath); // compiled once, scripts validate a path per command
+    return std::regex_match(path, filePath);
 }